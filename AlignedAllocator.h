@@ -0,0 +1,46 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+// std::vector allocator with a fixed alignment, so SIMD kernels start every
+// plane on a cache line
+template <typename T, std::size_t Alignment>
+struct AlignedAllocator
+{
+	using value_type = T;
+
+	template <typename U>
+	struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+	AlignedAllocator() = default;
+
+	template <typename U>
+	AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+	// over-allocate and keep the raw pointer just in front of the aligned block
+	// (aligned operator new needs c++17, the project builds as c++14)
+	T* allocate(std::size_t count)
+	{
+		void* raw = ::operator new(count * sizeof(T) + Alignment + sizeof(void*));
+		std::uintptr_t aligned = (reinterpret_cast<std::uintptr_t>(raw) + sizeof(void*) + Alignment - 1)
+			& ~(std::uintptr_t)(Alignment - 1);
+		reinterpret_cast<void**>(aligned)[-1] = raw;
+		return reinterpret_cast<T*>(aligned);
+	}
+
+	void deallocate(T* ptr, std::size_t)
+	{
+		::operator delete(reinterpret_cast<void**>(ptr)[-1]);
+	}
+};
+
+template <typename T, typename U, std::size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&) { return true; }
+
+template <typename T, typename U, std::size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&) { return false; }
+
+// one scalar grid plane (halo padded, see GridHalo.h)
+using FloatPlane = std::vector<float, AlignedAllocator<float, 64>>;
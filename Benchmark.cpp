@@ -0,0 +1,288 @@
+#include "Benchmark.h"
+#include "FluidGrid.h"
+#include "FluidGrid3D.h"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+static void seedGrid(FluidGrid& grid, int size)
+{
+	// same splat for every run so results can be compared bit for bit
+	int center = size / 2;
+	int radius = size / 16;
+	for (int y = center - radius; y <= center + radius; ++y)
+	{
+		for (int x = center - radius; x <= center + radius; ++x)
+		{
+			grid.addDensity(x, y, 1.0f);
+			grid.addVelocity(x, y, 2.0f, 5.0f);
+		}
+	}
+}
+
+int runThreadScalingBenchmark()
+{
+	const int sizes[] = { 512, 2048 };
+	const int warmup_steps = 1;
+	const int timed_steps = 3;
+
+	int max_threads = (int)std::thread::hardware_concurrency();
+	if (max_threads < 1) max_threads = 1;
+
+	// 1, 2, 4, ... plus the core count itself
+	std::vector<int> thread_counts;
+	for (int t = 1; t < max_threads; t *= 2)
+		thread_counts.push_back(t);
+	thread_counts.push_back(max_threads);
+
+	bool all_identical = true;
+
+	for (int size : sizes)
+	{
+		std::cout << "FluidGrid " << size << "x" << size << std::endl;
+		std::cout << std::setw(8) << "threads" << std::setw(12) << "ms/step"
+			<< std::setw(10) << "speedup" << std::setw(12) << "identical"
+			<< std::setw(8) << "stalls" << std::endl;
+
+		FloatPlane reference;
+		double base_ms = 0.0;
+
+		for (int threads : thread_counts)
+		{
+			FluidGrid grid(size, size);
+			grid.setThreadCount(threads);
+			seedGrid(grid, size);
+
+			for (int i = 0; i < warmup_steps; ++i)
+				grid.step();
+
+			// pressure solves that gave up at float precision instead of reaching the tolerance
+			int stalls = 0;
+			auto start = std::chrono::high_resolution_clock::now();
+			for (int i = 0; i < timed_steps; ++i)
+			{
+				grid.step();
+				stalls += grid.getLastPressureStalled() ? 1 : 0;
+			}
+			auto end = std::chrono::high_resolution_clock::now();
+
+			double ms = std::chrono::duration<double, std::milli>(end - start).count() / timed_steps;
+
+			bool identical = true;
+			if (reference.empty())
+			{
+				reference = grid.getDensity();
+				base_ms = ms;
+			}
+			else
+			{
+				identical = grid.getDensity() == reference;
+				all_identical = all_identical && identical;
+			}
+
+			std::cout << std::setw(8) << threads
+				<< std::setw(12) << std::fixed << std::setprecision(2) << ms
+				<< std::setw(10) << std::setprecision(2) << base_ms / ms
+				<< std::setw(12) << (identical ? "yes" : "NO")
+				<< std::setw(8) << stalls << std::endl;
+		}
+		std::cout << std::endl;
+	}
+
+	return all_identical ? 0 : 1;
+}
+
+int runKernelBenchmark()
+{
+	const int sizes[] = { 512, 2048 };
+	const int warmup_steps = 1;
+	const int timed_steps = 3;
+	const KernelIsa isas[] = { KernelIsa::Scalar, KernelIsa::Avx2, KernelIsa::Avx512 };
+
+	std::cout << "detected isa: " << kernelIsaName(detectKernelIsa()) << std::endl << std::endl;
+
+	bool all_identical = true;
+
+	for (int size : sizes)
+	{
+		std::cout << "FluidGrid " << size << "x" << size << std::endl;
+		std::cout << std::setw(8) << "isa" << std::setw(12) << "ms/step"
+			<< std::setw(10) << "speedup" << std::setw(12) << "identical" << std::endl;
+
+		FloatPlane reference_density;
+		FloatPlane reference_u;
+		FloatPlane reference_v;
+		double base_ms = 0.0;
+
+		for (KernelIsa isa : isas)
+		{
+			FluidGrid grid(size, size);
+			if (!grid.setKernelIsa(isa))
+			{
+				std::cout << std::setw(8) << kernelIsaName(isa) << std::setw(12) << "n/a" << std::endl;
+				continue;
+			}
+			seedGrid(grid, size);
+
+			for (int i = 0; i < warmup_steps; ++i)
+				grid.step();
+
+			auto start = std::chrono::high_resolution_clock::now();
+			for (int i = 0; i < timed_steps; ++i)
+				grid.step();
+			auto end = std::chrono::high_resolution_clock::now();
+
+			double ms = std::chrono::duration<double, std::milli>(end - start).count() / timed_steps;
+
+			// scalar runs first and is the reference
+			bool identical = true;
+			if (isa == KernelIsa::Scalar)
+			{
+				reference_density = grid.getDensity();
+				reference_u = grid.getVelocityX();
+				reference_v = grid.getVelocityY();
+				base_ms = ms;
+			}
+			else
+			{
+				identical = grid.getDensity() == reference_density &&
+					grid.getVelocityX() == reference_u &&
+					grid.getVelocityY() == reference_v;
+				all_identical = all_identical && identical;
+			}
+
+			std::cout << std::setw(8) << kernelIsaName(isa)
+				<< std::setw(12) << std::fixed << std::setprecision(2) << ms
+				<< std::setw(10) << std::setprecision(2) << base_ms / ms
+				<< std::setw(12) << (identical ? "yes" : "NO") << std::endl;
+		}
+		std::cout << std::endl;
+	}
+
+	return all_identical ? 0 : 1;
+}
+
+int runGrid3DBenchmark()
+{
+	const int sizes[] = { 64, 128 };
+	const int warmup_steps = 1;
+	const int timed_steps = 3;
+
+	// same settings main.cpp runs GpuGrid3D with
+	const float dt = 1.0f / 60.0f;
+	const float viscosity = .000001f;
+	const int diffuse_iterations = 4;
+	const int pressure_iterations = 4;
+
+	int max_threads = (int)std::thread::hardware_concurrency();
+	if (max_threads < 1) max_threads = 1;
+
+	std::vector<int> thread_counts;
+	for (int t = 1; t < max_threads; t *= 2)
+		thread_counts.push_back(t);
+	thread_counts.push_back(max_threads);
+
+	bool all_identical = true;
+
+	for (int size : sizes)
+	{
+		std::cout << "FluidGrid3D " << size << "^3" << std::endl;
+		std::cout << std::setw(8) << "threads" << std::setw(12) << "ms/step"
+			<< std::setw(10) << "speedup" << std::setw(12) << "identical" << std::endl;
+
+		FloatPlane reference;
+		double base_ms = 0.0;
+
+		for (int threads : thread_counts)
+		{
+			FluidGrid3D grid(size, size, size);
+			grid.setThreadCount(threads);
+
+			// brush held in the middle, pushing up
+			glm::vec3 center = glm::vec3((float)size * .5f);
+			glm::vec3 force = glm::vec3(0.0f, 50.0f, 0.0f);
+
+			for (int i = 0; i < warmup_steps; ++i)
+				grid.step(center, force, true, dt, viscosity, diffuse_iterations, pressure_iterations);
+
+			auto start = std::chrono::high_resolution_clock::now();
+			for (int i = 0; i < timed_steps; ++i)
+				grid.step(center, force, true, dt, viscosity, diffuse_iterations, pressure_iterations);
+			auto end = std::chrono::high_resolution_clock::now();
+
+			double ms = std::chrono::duration<double, std::milli>(end - start).count() / timed_steps;
+
+			bool identical = true;
+			if (reference.empty())
+			{
+				reference = grid.getDensity();
+				base_ms = ms;
+			}
+			else
+			{
+				identical = grid.getDensity() == reference;
+				all_identical = all_identical && identical;
+			}
+
+			std::cout << std::setw(8) << threads
+				<< std::setw(12) << std::fixed << std::setprecision(2) << ms
+				<< std::setw(10) << std::setprecision(2) << base_ms / ms
+				<< std::setw(12) << (identical ? "yes" : "NO") << std::endl;
+		}
+		std::cout << std::endl;
+	}
+
+	return all_identical ? 0 : 1;
+}
+
+int runActiveTilesBenchmark()
+{
+	const int sizes[] = { 512, 2048 };
+	const int warmup_steps = 1;
+	const int timed_steps = 3;
+
+	for (int size : sizes)
+	{
+		std::cout << "FluidGrid " << size << "x" << size << std::endl;
+		std::cout << std::setw(8) << "tiles" << std::setw(8) << "seed" << std::setw(12) << "ms/step"
+			<< std::setw(10) << "speedup" << std::setw(10) << "awake" << std::endl;
+
+		// splat vs an empty grid, the empty one should go idle
+		for (int seeded = 1; seeded >= 0; --seeded)
+		{
+			double dense_ms = 0.0;
+			for (int tiles = 0; tiles <= 1; ++tiles)
+			{
+				FluidGrid grid(size, size);
+				grid.setActiveTiles(tiles != 0);
+				if (seeded)
+					seedGrid(grid, size);
+
+				for (int i = 0; i < warmup_steps; ++i)
+					grid.step();
+
+				auto start = std::chrono::high_resolution_clock::now();
+				for (int i = 0; i < timed_steps; ++i)
+					grid.step();
+				auto end = std::chrono::high_resolution_clock::now();
+
+				double ms = std::chrono::duration<double, std::milli>(end - start).count() / timed_steps;
+				if (!tiles)
+					dense_ms = ms;
+
+				std::cout << std::setw(8) << (tiles ? "on" : "off")
+					<< std::setw(8) << (seeded ? "splat" : "empty")
+					<< std::setw(12) << std::fixed << std::setprecision(2) << ms
+					<< std::setw(10) << std::setprecision(2) << dense_ms / ms;
+				if (tiles)
+					std::cout << std::setw(5) << grid.getAwakeTileCount() << "/" << grid.getTileCount();
+				std::cout << std::endl;
+			}
+		}
+		std::cout << std::endl;
+	}
+
+	return 0;
+}
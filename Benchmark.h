@@ -0,0 +1,17 @@
+#pragma once
+
+// FluidGrid::step timing at 512^2 and 2048^2 for 1..N solver threads,
+// also checks that every thread count gives the same density as 1 thread
+int runThreadScalingBenchmark();
+
+// FluidGrid::step timing per kernel isa (scalar, avx2, avx512 where the cpu has them),
+// also checks that density and velocity match the scalar kernels bit for bit
+int runKernelBenchmark();
+
+// FluidGrid3D (cpu GpuGrid3D) step timing at 64^3 and 128^3 for 1..N threads,
+// checks density against the 1 thread run
+int runGrid3DBenchmark();
+
+// FluidGrid::step timing at 512^2 and 2048^2 with and without active tiles,
+// for the usual splat and for an empty grid (which should go idle)
+int runActiveTilesBenchmark();
@@ -0,0 +1,545 @@
+#include "BenchmarkSweep.h"
+#include <glad/glad.h>
+#include "FluidGrid.h"
+#include "FluidGrid3D.h"
+#include "GpuGrid3D.h"
+#include "Headless.h"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+
+struct SweepOptions
+{
+	std::vector<std::string> backends = { "cpu2d", "cpu3d", "gpu3d", "gpu3d-mg" };
+	std::vector<int> sizes = { 32, 64, 128, 256 };
+	std::vector<int> diffuse_iterations = { 4 };
+	std::vector<int> pressure_iterations = { 4, 20 };
+	std::vector<int> thread_counts; // empty: 1 and the core count
+
+	int warmup_steps = 2;
+	int repetitions = 5;
+	int steps_per_rep = 3;
+
+	std::string csv_path;
+	std::string json_path;
+	std::string baseline_path;
+	double threshold_percent = 10.0; // slower than baseline by more than this is a regression
+};
+
+struct SweepResult
+{
+	std::string backend;
+	int width, height, depth;
+	int diffuse_iterations;
+	int pressure_iterations;
+	int threads; // 0 for the gpu
+
+	double ms_median; // per step, median over the repetitions
+	double ms_min;
+	double bytes_per_step;
+
+	double cells() const { return (double)width * height * depth; }
+	double cellsPerSecond() const { return cells() / (ms_median * 1e-3); }
+	double gigabytesPerSecond() const { return bytes_per_step / (ms_median * 1e-3) * 1e-9; }
+
+	std::string gridName() const
+	{
+		std::string name = std::to_string(width) + "x" + std::to_string(height);
+		if (depth > 1)
+			name += "x" + std::to_string(depth);
+		return name;
+	}
+
+	// rows are matched against the baseline by this
+	std::string key() const
+	{
+		return backend + "|" + gridName() + "|" + std::to_string(diffuse_iterations) + "|" +
+			std::to_string(pressure_iterations) + "|" + std::to_string(threads);
+	}
+};
+
+// settings main.cpp runs the 3d grids with
+static const float k_dt = 1.0f / 60.0f;
+static const float k_viscosity = .000001f;
+
+static bool parseIntList(const char* text, std::vector<int>& values, int max_value)
+{
+	values.clear();
+	std::stringstream stream(text);
+	std::string item;
+	while (std::getline(stream, item, ','))
+	{
+		// "max" is the core count for --threads
+		int value = item == "max" ? max_value : std::atoi(item.c_str());
+		if (value < 1)
+			return false;
+		values.push_back(value);
+	}
+	return !values.empty();
+}
+
+static bool parseOptions(int argc, char** argv, SweepOptions& options)
+{
+	int max_threads = std::max((int)std::thread::hardware_concurrency(), 1);
+
+	for (int i = 0; i < argc; ++i)
+	{
+		const char* arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+		bool ok = value != nullptr;
+
+		if (std::strcmp(arg, "--backends") == 0 && value)
+		{
+			options.backends.clear();
+			std::stringstream stream(value);
+			std::string item;
+			while (std::getline(stream, item, ','))
+			{
+				if (item != "cpu2d" && item != "cpu3d" && item != "gpu3d" && item != "gpu3d-mg")
+				{
+					std::cerr << "unknown backend " << item << std::endl;
+					return false;
+				}
+				options.backends.push_back(item);
+			}
+		}
+		else if (std::strcmp(arg, "--sizes") == 0 && value)
+			ok = parseIntList(value, options.sizes, max_threads);
+		else if (std::strcmp(arg, "--diffuse") == 0 && value)
+			ok = parseIntList(value, options.diffuse_iterations, max_threads);
+		else if (std::strcmp(arg, "--pressure") == 0 && value)
+			ok = parseIntList(value, options.pressure_iterations, max_threads);
+		else if (std::strcmp(arg, "--threads") == 0 && value)
+			ok = parseIntList(value, options.thread_counts, max_threads);
+		else if (std::strcmp(arg, "--warmup") == 0 && value)
+			ok = (options.warmup_steps = std::atoi(value)) >= 0;
+		else if (std::strcmp(arg, "--reps") == 0 && value)
+			ok = (options.repetitions = std::atoi(value)) >= 1;
+		else if (std::strcmp(arg, "--steps") == 0 && value)
+			ok = (options.steps_per_rep = std::atoi(value)) >= 1;
+		else if (std::strcmp(arg, "--csv") == 0 && value)
+			options.csv_path = value;
+		else if (std::strcmp(arg, "--json") == 0 && value)
+			options.json_path = value;
+		else if (std::strcmp(arg, "--baseline") == 0 && value)
+			options.baseline_path = value;
+		else if (std::strcmp(arg, "--threshold") == 0 && value)
+			ok = (options.threshold_percent = std::atof(value)) > 0.0;
+		else
+		{
+			std::cerr << "unknown sweep option " << arg << std::endl;
+			return false;
+		}
+
+		if (!ok)
+		{
+			std::cerr << "bad value for " << arg << std::endl;
+			return false;
+		}
+		++i; // every option takes a value
+	}
+
+	if (options.thread_counts.empty())
+	{
+		options.thread_counts.push_back(1);
+		if (max_threads > 1)
+			options.thread_counts.push_back(max_threads);
+	}
+	return true;
+}
+
+// runs warmup steps, then repetitions x steps_per_rep timed steps. sync is called
+// before reading the clock (glFinish for the gpu). fills ms_median / ms_min
+static void timeSteps(const SweepOptions& options, const std::function<void()>& step,
+	const std::function<void()>& sync, SweepResult& result)
+{
+	for (int i = 0; i < options.warmup_steps; ++i)
+		step();
+	sync();
+
+	std::vector<double> rep_ms;
+	for (int rep = 0; rep < options.repetitions; ++rep)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < options.steps_per_rep; ++i)
+			step();
+		sync();
+		auto end = std::chrono::high_resolution_clock::now();
+
+		rep_ms.push_back(std::chrono::duration<double, std::milli>(end - start).count() / options.steps_per_rep);
+	}
+
+	std::sort(rep_ms.begin(), rep_ms.end());
+	size_t mid = rep_ms.size() / 2;
+	result.ms_median = rep_ms.size() % 2 ? rep_ms[mid] : 0.5 * (rep_ms[mid - 1] + rep_ms[mid]);
+	result.ms_min = rep_ms.front();
+}
+
+// bytes touched per step, estimated as if every pass reads each input field once and
+// writes its output once (perfect caching of the stencil neighbours). good enough to
+// see how close a run is to memory bandwidth, not a measurement
+
+static double fluidGrid2DStepBytes(double cells, int diffuse_iterations, int pressure_iterations)
+{
+	const double s = sizeof(float);
+
+	// gauss-seidel in place: read x, read b, write x per sweep
+	double diffuse = 3.0 * s * diffuse_iterations * 3.0; // u, v, density
+	double advect = (2.0 + 2.0) * s * 2.0;               // velocity + source read, write, for velocity and density
+	double project = 3.0 * s + 3.0 * s * pressure_iterations + 5.0 * s; // divergence, sweeps, gradient
+	return cells * (diffuse + advect + project);
+}
+
+// FluidGrid3D and GpuGrid3D run the same passes, v is the bytes of one velocity cell
+static double grid3DStepBytes(double cells, double v, int velocity_diffuse_passes,
+	int density_diffuse_passes, double pressure_fields)
+{
+	const double s = sizeof(float);
+
+	double splat = 2.0 * v + 2.0 * s;
+	double diffuse = 3.0 * v * velocity_diffuse_passes + 3.0 * s * density_diffuse_passes;
+	double divergence = v + s;
+	double pressure = s * pressure_fields;
+	double gradient = 2.0 * v + s;
+	double advect = 2.0 * v + (v + 2.0 * s);
+	return cells * (splat + diffuse + divergence + pressure + gradient + advect);
+}
+
+static double texelBytes(GLenum format)
+{
+	switch (format)
+	{
+	case GL_R32F: return 4.0;
+	case GL_RGBA16F: return 8.0;
+	default: return 16.0;
+	}
+}
+
+static int ceilDiv(int a, int b)
+{
+	return (a + b - 1) / b;
+}
+
+static double gpuGridStepBytes(const GpuGrid3D& grid, int diffuse_iterations, int pressure_iterations)
+{
+	double cells = (double)grid.m_width * grid.m_height * grid.m_depth;
+	bool tiled_diffuse = grid.getTiledJacobi() && diffuse_iterations > 1;
+
+	// a tiled dispatch does up to K iterations for one read / write of the field
+	int velocity_passes = tiled_diffuse ? ceilDiv(diffuse_iterations, grid.getVelocityTileIterations()) : diffuse_iterations;
+	// density rides along in the velocity dispatches (the sweep never skips a field)
+	int density_passes = velocity_passes;
+
+	double pressure_fields;
+	if (grid.getPressureSolver() == GpuGrid3D::PressureSolver::Multigrid)
+	{
+		// per cycle on the finest level: pre + post smoothing (read p, rhs, write p per sweep),
+		// residual + restrict (read p, rhs, write 1/8) and prolong (read p + 1/8, write p).
+		// the coarser levels add ~1/7 on top
+		double fine = 2.0 * 3.0 * grid.getMultigridSmoothing() + 2.125 + 2.125;
+		pressure_fields = fine * 8.0 / 7.0 * grid.getMultigridCycles();
+	}
+	else
+	{
+		int passes = grid.getTiledJacobi() ? ceilDiv(pressure_iterations, grid.getScalarTileIterations()) : pressure_iterations;
+		pressure_fields = 3.0 * passes;
+	}
+
+	return grid3DStepBytes(cells, texelBytes(grid.m_velocityFormat), velocity_passes, density_passes, pressure_fields);
+}
+
+static void runFluidGrid2D(const SweepOptions& options, int size, std::vector<SweepResult>& results)
+{
+	// same cell count as the 3d grid of this size
+	int side = (int)std::lround(std::sqrt((double)size * size * size));
+
+	for (int diffuse : options.diffuse_iterations)
+	for (int pressure : options.pressure_iterations)
+	for (int threads : options.thread_counts)
+	{
+		FluidGrid grid(side, side);
+		grid.setThreadCount(threads);
+		grid.setDiffuseIterations(diffuse);
+		grid.setPressureSolver(FluidGrid::PressureSolver::GaussSeidel);
+		grid.setPressureTolerance(0.0f);
+		grid.setMaxPressureSweeps(pressure);
+
+		// same splat as the other cpu benchmarks
+		int center = side / 2;
+		int radius = side / 16;
+		for (int y = center - radius; y <= center + radius; ++y)
+		{
+			for (int x = center - radius; x <= center + radius; ++x)
+			{
+				grid.addDensity(x, y, 1.0f);
+				grid.addVelocity(x, y, 2.0f, 5.0f);
+			}
+		}
+
+		SweepResult result = { "cpu2d", side, side, 1, diffuse, pressure, threads, 0.0, 0.0, 0.0 };
+		timeSteps(options, [&]() { grid.step(); }, []() {}, result);
+		result.bytes_per_step = fluidGrid2DStepBytes(result.cells(), diffuse, pressure);
+		results.push_back(result);
+	}
+}
+
+static void runFluidGrid3D(const SweepOptions& options, int size, std::vector<SweepResult>& results)
+{
+	FluidGrid3D grid(size, size, size);
+
+	// brush held in the middle, pushing up
+	glm::vec3 center = glm::vec3((float)size * .5f);
+	glm::vec3 force = glm::vec3(0.0f, 50.0f, 0.0f);
+
+	for (int diffuse : options.diffuse_iterations)
+	for (int pressure : options.pressure_iterations)
+	for (int threads : options.thread_counts)
+	{
+		grid.clear();
+		grid.setThreadCount(threads);
+
+		SweepResult result = { "cpu3d", size, size, size, diffuse, pressure, threads, 0.0, 0.0, 0.0 };
+		timeSteps(options,
+			[&]() { grid.step(center, force, true, k_dt, k_viscosity, diffuse, pressure); },
+			[]() {}, result);
+
+		// u, v, w planes
+		result.bytes_per_step = grid3DStepBytes(result.cells(), 3.0 * sizeof(float),
+			diffuse, diffuse, 3.0 * pressure);
+		results.push_back(result);
+	}
+}
+
+static void runGpuGrid3D(const SweepOptions& options, const std::string& backend, int size,
+	std::vector<SweepResult>& results)
+{
+	// the app's texture formats
+	GpuGrid3D grid(size, size, size, GL_RGBA16F);
+	bool multigrid = backend == "gpu3d-mg";
+	grid.setPressureSolver(multigrid ? GpuGrid3D::PressureSolver::Multigrid : GpuGrid3D::PressureSolver::Jacobi);
+
+	glm::vec3 center = glm::vec3((float)size * .5f);
+	glm::vec3 force = glm::vec3(0.0f, 50.0f, 0.0f);
+
+	for (int diffuse : options.diffuse_iterations)
+	for (int pressure : options.pressure_iterations)
+	{
+		grid.clear();
+		if (multigrid)
+			grid.setMultigridCycles(pressure);
+
+		SweepResult result = { backend, size, size, size, diffuse, pressure, 0, 0.0, 0.0, 0.0 };
+		timeSteps(options,
+			[&]() { grid.step(center, force, true, k_dt, k_viscosity, diffuse, pressure); },
+			[]() { glFinish(); }, result);
+		result.bytes_per_step = gpuGridStepBytes(grid, diffuse, pressure);
+		results.push_back(result);
+	}
+}
+
+static void printHeader()
+{
+	std::cout << std::setw(10) << "backend" << std::setw(16) << "grid"
+		<< std::setw(9) << "diffuse" << std::setw(10) << "pressure" << std::setw(9) << "threads"
+		<< std::setw(12) << "ms/step" << std::setw(12) << "min ms"
+		<< std::setw(14) << "Mcells/s" << std::setw(12) << "MB/step" << std::setw(10) << "GB/s" << std::endl;
+}
+
+static void printResult(const SweepResult& result)
+{
+	std::cout << std::setw(10) << result.backend << std::setw(16) << result.gridName()
+		<< std::setw(9) << result.diffuse_iterations << std::setw(10) << result.pressure_iterations
+		<< std::setw(9) << (result.threads > 0 ? std::to_string(result.threads) : "-")
+		<< std::fixed << std::setprecision(3)
+		<< std::setw(12) << result.ms_median << std::setw(12) << result.ms_min
+		<< std::setprecision(2)
+		<< std::setw(14) << result.cellsPerSecond() * 1e-6
+		<< std::setw(12) << result.bytes_per_step * 1e-6
+		<< std::setw(10) << result.gigabytesPerSecond() << std::endl;
+}
+
+static const char* k_csv_header = "backend,grid,cells,diffuse,pressure,threads,ms_step,ms_min,cells_per_s,bytes_step,gb_s";
+
+static bool writeCsv(const std::string& path, const std::vector<SweepResult>& results)
+{
+	std::ofstream file(path);
+	if (!file)
+		return false;
+
+	file << k_csv_header << "\n" << std::setprecision(9);
+	for (const SweepResult& r : results)
+	{
+		file << r.backend << "," << r.gridName() << "," << (long long)r.cells() << ","
+			<< r.diffuse_iterations << "," << r.pressure_iterations << "," << r.threads << ","
+			<< r.ms_median << "," << r.ms_min << "," << r.cellsPerSecond() << ","
+			<< r.bytes_per_step << "," << r.gigabytesPerSecond() << "\n";
+	}
+	return (bool)file;
+}
+
+static bool writeJson(const std::string& path, const std::vector<SweepResult>& results)
+{
+	std::ofstream file(path);
+	if (!file)
+		return false;
+
+	file << "[\n" << std::setprecision(9);
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const SweepResult& r = results[i];
+		file << "  { \"backend\": \"" << r.backend << "\", \"grid\": \"" << r.gridName() << "\""
+			<< ", \"cells\": " << (long long)r.cells()
+			<< ", \"diffuse\": " << r.diffuse_iterations << ", \"pressure\": " << r.pressure_iterations
+			<< ", \"threads\": " << r.threads
+			<< ", \"ms_step\": " << r.ms_median << ", \"ms_min\": " << r.ms_min
+			<< ", \"cells_per_s\": " << r.cellsPerSecond() << ", \"bytes_step\": " << r.bytes_per_step
+			<< ", \"gb_s\": " << r.gigabytesPerSecond() << " }"
+			<< (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	file << "]\n";
+	return (bool)file;
+}
+
+// key -> ms/step from a csv written by an earlier --csv run
+static bool readBaseline(const std::string& path, std::map<std::string, double>& baseline)
+{
+	std::ifstream file(path);
+	std::string line;
+	if (!file || !std::getline(file, line))
+		return false;
+
+	// find the columns by name so older / newer files still line up
+	std::vector<std::string> columns;
+	std::stringstream header(line);
+	std::string item;
+	while (std::getline(header, item, ','))
+		columns.push_back(item);
+
+	auto column = [&](const char* name) {
+		return (int)(std::find(columns.begin(), columns.end(), name) - columns.begin());
+	};
+	int backend = column("backend"), grid = column("grid"), diffuse = column("diffuse"),
+		pressure = column("pressure"), threads = column("threads"), ms = column("ms_step");
+	int column_count = (int)columns.size();
+	if (std::max({ backend, grid, diffuse, pressure, threads, ms }) >= column_count)
+		return false;
+
+	while (std::getline(file, line))
+	{
+		std::vector<std::string> fields;
+		std::stringstream row(line);
+		while (std::getline(row, item, ','))
+			fields.push_back(item);
+		if ((int)fields.size() < column_count)
+			continue;
+
+		std::string key = fields[backend] + "|" + fields[grid] + "|" + fields[diffuse] + "|" +
+			fields[pressure] + "|" + fields[threads];
+		baseline[key] = std::atof(fields[ms].c_str());
+	}
+	return true;
+}
+
+// prints every row that has a baseline entry, returns how many got slower than the threshold
+static int compareBaseline(const std::vector<SweepResult>& results,
+	const std::map<std::string, double>& baseline, double threshold_percent)
+{
+	std::cout << std::defaultfloat << "baseline comparison (regression: more than " << threshold_percent << "% slower)" << std::endl;
+	std::cout << std::setw(10) << "backend" << std::setw(16) << "grid"
+		<< std::setw(9) << "diffuse" << std::setw(10) << "pressure" << std::setw(9) << "threads"
+		<< std::setw(12) << "base ms" << std::setw(12) << "ms/step" << std::setw(10) << "change" << std::endl;
+
+	int regressions = 0;
+	int matched = 0;
+	for (const SweepResult& r : results)
+	{
+		auto it = baseline.find(r.key());
+		if (it == baseline.end() || it->second <= 0.0)
+			continue;
+		++matched;
+
+		double change = (r.ms_median / it->second - 1.0) * 100.0;
+		bool regression = change > threshold_percent;
+		regressions += regression ? 1 : 0;
+
+		std::cout << std::setw(10) << r.backend << std::setw(16) << r.gridName()
+			<< std::setw(9) << r.diffuse_iterations << std::setw(10) << r.pressure_iterations
+			<< std::setw(9) << (r.threads > 0 ? std::to_string(r.threads) : "-")
+			<< std::fixed << std::setprecision(3)
+			<< std::setw(12) << it->second << std::setw(12) << r.ms_median
+			<< std::setprecision(1) << std::setw(9) << std::showpos << change << "%" << std::noshowpos
+			<< (regression ? "  REGRESSION" : "") << std::endl;
+	}
+
+	std::cout << matched << " rows compared, " << regressions << " regressions" << std::endl;
+	return regressions;
+}
+
+int runSweepBenchmark(int argc, char** argv)
+{
+	SweepOptions options;
+	if (!parseOptions(argc, argv, options))
+		return 1;
+
+	bool wants_gpu = std::find_if(options.backends.begin(), options.backends.end(),
+		[](const std::string& b) { return b.compare(0, 3, "gpu") == 0; }) != options.backends.end();
+	bool has_gpu = wants_gpu && createHeadlessContext();
+	if (wants_gpu && !has_gpu)
+		std::cout << "no GL context, skipping the gpu backends" << std::endl;
+	if (has_gpu)
+		std::cout << "gpu: " << glGetString(GL_RENDERER) << std::endl;
+
+	std::cout << "warmup " << options.warmup_steps << " steps, " << options.repetitions
+		<< " reps x " << options.steps_per_rep << " steps, median per step" << std::endl << std::endl;
+	printHeader();
+
+	std::vector<SweepResult> results;
+	for (const std::string& backend : options.backends)
+	{
+		for (int size : options.sizes)
+		{
+			size_t first = results.size();
+
+			if (backend == "cpu2d")
+				runFluidGrid2D(options, size, results);
+			else if (backend == "cpu3d")
+				runFluidGrid3D(options, size, results);
+			else if (has_gpu)
+				runGpuGrid3D(options, backend, size, results);
+
+			for (size_t i = first; i < results.size(); ++i)
+				printResult(results[i]);
+		}
+	}
+	std::cout << std::endl;
+
+	if (has_gpu)
+		destroyHeadlessContext();
+
+	if (!options.csv_path.empty() && !writeCsv(options.csv_path, results))
+		std::cerr << "failed to write " << options.csv_path << std::endl;
+	if (!options.json_path.empty() && !writeJson(options.json_path, results))
+		std::cerr << "failed to write " << options.json_path << std::endl;
+
+	if (options.baseline_path.empty())
+		return 0;
+
+	std::map<std::string, double> baseline;
+	if (!readBaseline(options.baseline_path, baseline))
+	{
+		std::cerr << "failed to read baseline " << options.baseline_path << std::endl;
+		return 1;
+	}
+	return compareBaseline(results, baseline, options.threshold_percent) > 0 ? 1 : 0;
+}
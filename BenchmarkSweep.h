@@ -0,0 +1,11 @@
+#pragma once
+
+// step timing over a matrix of backends x grid sizes x diffuse / pressure iterations x threads.
+// backends: cpu2d (FluidGrid, gauss-seidel pressure, same cell count as the 3d size),
+// cpu3d (FluidGrid3D), gpu3d (GpuGrid3D jacobi) and gpu3d-mg (GpuGrid3D multigrid, the
+// pressure count is V-cycles). the gpu ones run in a headless context, skipped without one.
+// reports ms/step, cells/s and estimated bytes touched per step, optionally to csv / json,
+// and flags rows that got slower than a baseline csv from an earlier run.
+// args are what follows --bench-sweep on the command line, see README for the options.
+// returns 1 if a regression was found or an option is wrong
+int runSweepBenchmark(int argc, char** argv);
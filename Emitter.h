@@ -0,0 +1,59 @@
+#pragma once
+#include <cmath>
+#include <algorithm>
+#include <glm/glm.hpp>
+
+// smoke sources, shared by GpuGrid3D (splat.comp) and FluidGrid. positions and sizes are
+// in grid cells. an emitter adds rate * weight * dt density and force * weight * dt velocity
+// per step, weight being 1 at its core and falling off to 0 at its edge
+enum class EmitterShape
+{
+	Point,  // exp(-dist / size.x), the mouse brush
+	Sphere, // 1 inside radius size.x, one cell of falloff
+	Box     // 1 inside half extents size, one cell of falloff
+};
+
+struct Emitter
+{
+	EmitterShape shape;
+	glm::vec3 position;
+	glm::vec3 size;
+	float rate;       // density per second
+	glm::vec3 force;  // velocity per second
+};
+
+// exp(-dist / radius) is below 1e-4 past ~9.2 radii, points are cut off there
+const float k_point_emitter_reach = 9.2f;
+
+// half extent of the cells an emitter writes, per axis
+inline glm::vec3 emitterReach(const Emitter& emitter)
+{
+	switch (emitter.shape)
+	{
+	case EmitterShape::Point: return glm::vec3(emitter.size.x * k_point_emitter_reach);
+	case EmitterShape::Sphere: return glm::vec3(emitter.size.x + .5f);
+	default: return emitter.size + .5f;
+	}
+}
+
+// same math as emitterWeight in splat.comp
+inline float emitterWeight(const Emitter& emitter, const glm::vec3& cell)
+{
+	glm::vec3 offset = cell - emitter.position;
+	float dist = std::sqrt(offset.x * offset.x + offset.y * offset.y + offset.z * offset.z);
+
+	switch (emitter.shape)
+	{
+	case EmitterShape::Point:
+		return dist > emitter.size.x * k_point_emitter_reach ? 0.0f : std::exp(-dist / emitter.size.x);
+	case EmitterShape::Sphere:
+		return std::min(std::max(emitter.size.x + .5f - dist, 0.0f), 1.0f);
+	default:
+	{
+		float weight = 1.0f;
+		for (int i = 0; i < 3; ++i)
+			weight *= std::min(std::max(emitter.size[i] + .5f - std::abs(offset[i]), 0.0f), 1.0f);
+		return weight;
+	}
+	}
+}
@@ -1,312 +1,575 @@
 #include "FluidGrid.h"
+#include "GridHalo.h"
+#include <thread>
+#include <algorithm>
+#include <cmath>
 
-static int IX(int x, int y, int width)
+static int IX(int x, int y, int width, int height)
 {
-	// clamp
+	// clamp into the interior, only used for user input now
 	if (x < 0) x = 0;
 	if (x >= width) x = width - 1;
 	if (y < 0) y = 0;
-	if (y >= width) y = width - 1;  // its a square, so its valid
+	if (y >= height) y = height - 1;
 
-	return x + y * width;
-}
-
-static float lerp(float a, float b, float t) // <3
-{
-	return a + t * (b - a);
-}
-
-static float sample(const std::vector<float>&buffer, float x, float y, int width)
-{
-	int x0 = (int)x;
-	int x1 = x0 + 1;
-	int y0 = (int)y;
-	int y1 = y0 + 1;
-
-	// fractional part
-	float sx = x - (float)x0;
-	float sy = y - (float)y0;
-
-	// sample corners
-	float v00 = buffer[IX(x0, y0, width)];
-	float v10 = buffer[IX(x1, y0, width)];
-	float v01 = buffer[IX(x0, y1, width)];
-	float v11 = buffer[IX(x1, y1, width)];
-
-	// bilinear interp
-	float top = lerp(v00, v10, sx);
-	float bottom = lerp(v01, v11, sx);
-
-	return lerp(top, bottom, sy);
-}
-
-static glm::vec2 sampleVec2(const std::vector<glm::vec2>& buffer, float x, float y, int width)
-{
-	int x0 = (int)x;
-	int x1 = x0 + 1;
-	int y0 = (int)y;
-	int y1 = y0 + 1;
-	// fractional part
-	float sx = x - (float)x0;
-	float sy = y - (float)y0;
-	// sample corners
-	glm::vec2 v00 = buffer[IX(x0, y0, width)];
-	glm::vec2 v10 = buffer[IX(x1, y0, width)];
-	glm::vec2 v01 = buffer[IX(x0, y1, width)];
-	glm::vec2 v11 = buffer[IX(x1, y1, width)];
-	// bilinear interp
-	glm::vec2 top = glm::mix(v00, v10, sx);
-	glm::vec2 bottom = glm::mix(v01, v11, sx);
-	return glm::mix(top, bottom, sy);
+	return haloIndex(x, y, width);
 }
 
 FluidGrid::FluidGrid(int width, int height)
 	: m_width(width), m_height(height), 
 	m_delta_time(.1f), m_viscosity(.0001f), 
-	m_global_force(.0f, -.05f)
+	m_global_force(.0f, -.05f),
+	m_diffuse_iterations(20),
+	m_pressure_solver(PressureSolver::Multigrid),
+	m_pressure_tolerance(1e-3f), m_max_pressure_cycles(10),
+	m_max_pressure_sweeps(20), m_pressure_check_interval(4),
+	m_pressure_warm_start(true),
+	m_last_pressure_iterations(0), m_last_pressure_residual(0.0f), m_last_pressure_stalled(false),
+	m_target_cfl(0.0f), m_max_substeps(8), m_last_substeps(1),
+	m_active_tiles(false), m_tile_threshold(1e-4f)
 {
-	int size = width * height;
+	m_kernel_isa = detectKernelIsa();
+	m_kernels = getFluidKernels(m_kernel_isa);
+
+	// interior + one cell halo
+	m_stride = width + 2;
+	int size = m_stride * (height + 2);
 	m_density_read.resize(size, 0.0f);
 	m_density_write.resize(size, 0.0f);
-	m_velocity_read.resize(size, glm::vec2(0.0f));
-	m_velocity_write.resize(size, glm::vec2(0.0f));
+	m_velocity_read.u.resize(size, 0.0f);
+	m_velocity_read.v.resize(size, 0.0f);
+	m_velocity_write.u.resize(size, 0.0f);
+	m_velocity_write.v.resize(size, 0.0f);
 
 	m_divergence.resize(size, 0.0f);
 	m_pressure.resize(size, 0.0f);
+	m_residual_row_sums.resize(2 * height, 0.0);
+	m_row_max_velocity.resize(height, 0.0f);
+
+	m_multigrid = std::make_unique<Multigrid>(width, height);
+	m_multigrid->setKernels(m_kernels);
+
+	m_tiles_x = (width + k_tile_size - 1) / k_tile_size;
+	m_tiles_y = (height + k_tile_size - 1) / k_tile_size;
+	m_tile_content.resize(m_tiles_x * m_tiles_y, 0);
+	m_tile_awake.resize(m_tiles_x * m_tiles_y, 1);
+	m_tile_touched.resize(m_tiles_x * m_tiles_y, 0);
+	m_tile_spans.resize(m_tiles_y);
+	resetTileSpans();
+
+	setThreadCount((int)std::thread::hardware_concurrency());
 }
 
-void FluidGrid::addDensity(int x, int y, float amount)
+FluidGrid::~FluidGrid() = default;
+
+void FluidGrid::setThreadCount(int thread_count)
 {
-	m_density_read[IX(x, y, m_width)] += amount;
+	if (thread_count < 1) thread_count = 1;
+	m_pool = std::make_unique<ThreadPool>(thread_count);
 }
 
-void FluidGrid::addVelocity(int x, int y, float forceX, float forceY)
+bool FluidGrid::setKernelIsa(KernelIsa isa)
 {
-	m_velocity_read[IX(x, y, m_width)] += glm::vec2(forceX, forceY);
+	const FluidKernels* kernels = getFluidKernels(isa);
+	if (!kernels)
+		return false;
+
+	m_kernel_isa = isa;
+	m_kernels = kernels;
+	m_multigrid->setKernels(kernels);
+	return true;
 }
 
-void FluidGrid::swapBuffers()
+void FluidGrid::addDensity(int x, int y, float amount)
 {
-	std::swap(m_density_read, m_density_write);
-	std::swap(m_velocity_read, m_velocity_write);
+	m_density_read[IX(x, y, m_width, m_height)] += amount;
+	m_tile_touched[tileIndex(x, y)] = 1;
 }
 
-void FluidGrid::advect(std::vector<float>& read_buffer, std::vector<float>& write_buffer, const std::vector<glm::vec2>& velocity_field)
+void FluidGrid::addVelocity(int x, int y, float forceX, float forceY)
 {
-	for (int y = 0; y < m_height; ++y)
-	{
-		for (int x = 0; x < m_width; ++x)
-		{
-			// get 1d index
-			int index = IX(x, y, m_width);
-
-			// get velocity
-			glm::vec2 velocity = velocity_field[index];
-
-			// backtrace
-			float current_x = (float)x + .5f;
-			float current_y = (float)y + .5f;
-			// back to the future
-			float prev_x = current_x - velocity.x * m_delta_time;
-			float prev_y = current_y - velocity.y * m_delta_time;
+	int index = IX(x, y, m_width, m_height);
+	m_velocity_read.u[index] += forceX;
+	m_velocity_read.v[index] += forceY;
+	m_tile_touched[tileIndex(x, y)] = 1;
+}
 
-			// sample
-			float new_density = sample(read_buffer, prev_x, prev_y, m_width);
+void FluidGrid::applyEmitters()
+{
+	// through addDensity / addVelocity, so the tiles they write wake up
+	for (const Emitter& emitter : m_emitters)
+	{
+		glm::vec3 reach = emitterReach(emitter);
+		int x_begin = std::max((int)std::floor(emitter.position.x - reach.x), 0);
+		int x_end = std::min((int)std::ceil(emitter.position.x + reach.x) + 1, m_width);
+		int y_begin = std::max((int)std::floor(emitter.position.y - reach.y), 0);
+		int y_end = std::min((int)std::ceil(emitter.position.y + reach.y) + 1, m_height);
 
-			// write
-			write_buffer[index] = new_density;
+		for (int y = y_begin; y < y_end; ++y)
+		{
+			for (int x = x_begin; x < x_end; ++x)
+			{
+				float weight = emitterWeight(emitter, glm::vec3((float)x, (float)y, emitter.position.z)) * m_delta_time;
+				if (weight == 0.0f)
+					continue;
+				addDensity(x, y, emitter.rate * weight);
+				addVelocity(x, y, emitter.force.x * weight, emitter.force.y * weight);
+			}
 		}
 	}
 }
 
-void FluidGrid::diffuse(std::vector<float>& read_buffer, std::vector<float>& write_buffer, float diff_rate)
+int FluidGrid::tileIndex(int x, int y) const
 {
-	int iter = 20;
+	// clamped like IX
+	int tile_x = std::min(std::max(x, 0), m_width - 1) / k_tile_size;
+	int tile_y = std::min(std::max(y, 0), m_height - 1) / k_tile_size;
+	return tile_x + tile_y * m_tiles_x;
+}
 
-	// constant related to diffusion rate and time step
-	float a = m_delta_time * diff_rate * m_width * m_height;  // can be width*width for square grid
+void FluidGrid::setActiveTiles(bool enabled, float threshold)
+{
+	m_active_tiles = enabled;
+	m_tile_threshold = threshold;
 
-	// Gauss-Seidel relaxation
-	std::vector<float>& v = write_buffer; // solving for this
-	const std::vector<float>& v0 = read_buffer;  // initial state
+	// everything awake, the next substep puts the empty tiles to sleep
+	std::fill(m_tile_awake.begin(), m_tile_awake.end(), (unsigned char)1);
+	resetTileSpans();
+}
 
-	for (int k = 0; k < iter; ++k)
+void FluidGrid::resetTileSpans()
+{
+	// the whole row for every row of tiles
+	for (std::vector<glm::ivec2>& spans : m_tile_spans)
+		spans.assign(1, glm::ivec2(0, m_width));
+	m_awake_tile_count = m_tiles_x * m_tiles_y;
+}
+
+void FluidGrid::forEachSpan(const std::function<void(int y, int x_begin, int x_end)>& body)
+{
+	m_pool->parallelFor(0, m_height, [&](int row_begin, int row_end)
 	{
-		for (int y = 0; y < m_height; ++y)
+		for (int y = row_begin; y < row_end; ++y)
 		{
-			for (int x = 0; x < m_width; ++x)
-			{
-				int index = IX(x, y, m_width);
+			for (const glm::ivec2& span : m_tile_spans[y / k_tile_size])
+				body(y, span.x, span.y);
+		}
+	});
+}
 
-				// get vals of neighboring cells
-				float neighbor_sum = 
-					v[IX(x - 1, y, m_width)] +  // left
-					v[IX(x + 1, y, m_width)] +  // rigth
-					v[IX(x, y - 1, m_width)] +  // bottom
-					v[IX(x, y + 1, m_width)];   // top
+bool FluidGrid::tileHasContent(int tile_x, int tile_y) const
+{
+	int x_begin = tile_x * k_tile_size;
+	int x_end = std::min(x_begin + k_tile_size, m_width);
+	int y_begin = tile_y * k_tile_size;
+	int y_end = std::min(y_begin + k_tile_size, m_height);
+	for (int y = y_begin; y < y_end; ++y)
+	{
+		int index = haloIndex(x_begin, y, m_width);
+		for (int x = x_begin; x < x_end; ++x, ++index)
+		{
+			if (std::abs(m_density_read[index]) > m_tile_threshold)
+				return true;
+		}
+	}
+	return false;
+}
 
-				v[index] = (v0[index] + a * neighbor_sum) / (1 + 4 * a);
-			}
+void FluidGrid::clearTile(int tile_x, int tile_y)
+{
+	// everything the tiled passes write, so a sleeping tile reads as 0 when it wakes up
+	FloatPlane* planes[] = {
+		&m_density_read, &m_density_write,
+		&m_velocity_read.u, &m_velocity_read.v, &m_velocity_write.u, &m_velocity_write.v,
+		&m_divergence
+	};
+
+	int x_begin = tile_x * k_tile_size;
+	int x_end = std::min(x_begin + k_tile_size, m_width);
+	int y_begin = tile_y * k_tile_size;
+	int y_end = std::min(y_begin + k_tile_size, m_height);
+	for (FloatPlane* plane : planes)
+	{
+		for (int y = y_begin; y < y_end; ++y)
+		{
+			int index = haloIndex(x_begin, y, m_width);
+			std::fill(plane->begin() + index, plane->begin() + index + (x_end - x_begin), 0.0f);
 		}
 	}
 }
 
-void FluidGrid::diffuseVelocity(const std::vector<glm::vec2>& read_buffer, std::vector<glm::vec2>& write_buffer, float diff_rate)
+void FluidGrid::updateActiveTiles()
 {
-	int iter = 20;
+	// content: only awake tiles can hold anything, plus the ones written from outside
+	m_pool->parallelFor(0, m_tiles_y, [&](int row_begin, int row_end)
+	{
+		for (int tile_y = row_begin; tile_y < row_end; ++tile_y)
+		{
+			for (int tile_x = 0; tile_x < m_tiles_x; ++tile_x)
+			{
+				int tile = tile_x + tile_y * m_tiles_x;
+				bool content = m_tile_touched[tile] || (m_tile_awake[tile] && tileHasContent(tile_x, tile_y));
+				m_tile_content[tile] = content ? 1 : 0;
+			}
+		}
+	});
+	std::fill(m_tile_touched.begin(), m_tile_touched.end(), (unsigned char)0);
 
-	// constant related to diffusion rate and time step
-	float a = m_delta_time * diff_rate * m_width * m_height;  // can be width*width for square grid
-	
-	// Gauss-Seidel relaxation
-	std::vector<glm::vec2>& v = write_buffer; // solving for this
-	const std::vector<glm::vec2>& v0 = read_buffer;  // initial state
-	
-	for (int k = 0; k < iter; ++k)
+	// awake: content in the 3x3 tiles around, anything that moves or diffuses out of a
+	// tile within a substep lands in an awake one. a tile falling asleep is zeroed
+	m_pool->parallelFor(0, m_tiles_y, [&](int row_begin, int row_end)
 	{
-		for (int y = 0; y < m_height; ++y)
+		for (int tile_y = row_begin; tile_y < row_end; ++tile_y)
 		{
-			for (int x = 0; x < m_width; ++x)
+			std::vector<glm::ivec2>& spans = m_tile_spans[tile_y];
+			spans.clear();
+
+			for (int tile_x = 0; tile_x < m_tiles_x; ++tile_x)
 			{
-				int index = IX(x, y, m_width);
-				
-				// get vals of neighboring cells
-				glm::vec2 neighbor_sum =
-					v[IX(x - 1, y, m_width)] +  // left
-					v[IX(x + 1, y, m_width)] +  // rigth
-					v[IX(x, y - 1, m_width)] +  // bottom
-					v[IX(x, y + 1, m_width)];   // top
-				
-				v[index] = (v0[index] + a * neighbor_sum) / (1.0f + 4.0f * a);
+				bool awake = false;
+				for (int ny = std::max(tile_y - 1, 0); ny <= std::min(tile_y + 1, m_tiles_y - 1) && !awake; ++ny)
+				{
+					for (int nx = std::max(tile_x - 1, 0); nx <= std::min(tile_x + 1, m_tiles_x - 1); ++nx)
+						awake = awake || m_tile_content[nx + ny * m_tiles_x] != 0;
+				}
+
+				int tile = tile_x + tile_y * m_tiles_x;
+				if (m_tile_awake[tile] && !awake)
+					clearTile(tile_x, tile_y);
+				m_tile_awake[tile] = awake ? 1 : 0;
+
+				if (!awake)
+					continue;
+
+				// extend the last run or start a new one
+				int x_begin = tile_x * k_tile_size;
+				int x_end = std::min(x_begin + k_tile_size, m_width);
+				if (!spans.empty() && spans.back().y == x_begin)
+					spans.back().y = x_end;
+				else
+					spans.push_back(glm::ivec2(x_begin, x_end));
 			}
 		}
-	}
+	});
+
+	int awake_count = 0;
+	for (unsigned char awake : m_tile_awake)
+		awake_count += awake;
+	m_awake_tile_count = awake_count;
 }
 
-void FluidGrid::advectVelocity(const std::vector<glm::vec2>& read_buffer, std::vector<glm::vec2>& write_buffer, const std::vector<glm::vec2>& velocity_field)
+void FluidGrid::swapBuffers()
 {
-	for (int y = 0; y < m_height; ++y)
+	std::swap(m_density_read, m_density_write);
+	std::swap(m_velocity_read, m_velocity_write);
+}
+
+void FluidGrid::advect(FloatPlane& read_buffer, FloatPlane& write_buffer, const VelocityField& velocity_field)
+{
+	fillHalo(read_buffer, m_width, m_height);
+
+	forEachSpan([&](int y, int x_begin, int x_end)
+	{
+		// backtrace each cell by its velocity and sample read_buffer there
+		int index = haloIndex(0, y, m_width);
+		m_kernels->advectRow(&write_buffer[index], read_buffer.data(),
+			&velocity_field.u[index], &velocity_field.v[index],
+			y, x_begin, x_end, m_width, m_height, m_delta_time);
+	});
+}
+
+void FluidGrid::linearSolve(FloatPlane& v, const FloatPlane& v0, float a, float c, int iterations)
+{
+	// red-black ordering: a red cell only reads black neighbours and the other way round,
+	// so every half sweep can be split by rows without races and the result does not
+	// depend on how many threads run it
+	for (int k = 0; k < iterations; ++k)
 	{
-		for (int x = 0; x < m_width; ++x)
+		for (int color = 0; color < 2; ++color)
 		{
-			// get 1d index
-			int index = IX(x, y, m_width);
-			// get velocity
-			glm::vec2 velocity = velocity_field[index];
-			// backtrace
-			float current_x = (float)x + .5f;
-			float current_y = (float)y + .5f;
-			// back to the future
-			float prev_x = current_x - velocity.x * m_delta_time;
-			float prev_y = current_y - velocity.y * m_delta_time;
-			// write
-			write_buffer[index] = sampleVec2(read_buffer, prev_x, prev_y, m_width);
+			// edge cells changed in the last half sweep
+			fillHalo(v, m_width, m_height);
+
+			// tiles are an even number of cells wide, a span starts on the row's parity
+			forEachSpan([&](int y, int x_begin, int x_end)
+			{
+				int index = haloIndex(x_begin, y, m_width);
+				m_kernels->relaxRow(&v[index], &v0[index], m_stride, x_end - x_begin, (y + color) & 1, a, c);
+			});
 		}
 	}
 }
 
-void FluidGrid::project(std::vector<glm::vec2>& velocity_field)
+void FluidGrid::diffuse(FloatPlane& read_buffer, FloatPlane& write_buffer, float diff_rate)
+{
+	int iter = m_diffuse_iterations;
+
+	// constant related to diffusion rate and time step
+	float a = m_delta_time * diff_rate * m_width * m_height;  // can be width*width for square grid
+
+	// Gauss-Seidel relaxation, solving for write_buffer with read_buffer as initial state
+	linearSolve(write_buffer, read_buffer, a, 1.0f + 4.0f * a, iter);
+}
+
+void FluidGrid::diffuseVelocity(const VelocityField& read_buffer, VelocityField& write_buffer, float diff_rate)
+{
+	int iter = m_diffuse_iterations;
+
+	// constant related to diffusion rate and time step
+	float a = m_delta_time * diff_rate * m_width * m_height;  // can be width*width for square grid
+
+	// Gauss-Seidel relaxation, components don't couple so each plane is its own solve
+	linearSolve(write_buffer.u, read_buffer.u, a, 1.0f + 4.0f * a, iter);
+	linearSolve(write_buffer.v, read_buffer.v, a, 1.0f + 4.0f * a, iter);
+}
+
+void FluidGrid::advectVelocity(VelocityField& read_buffer, VelocityField& write_buffer, const VelocityField& velocity_field)
+{
+	// each component is advected like a scalar field
+	advect(read_buffer.u, write_buffer.u, velocity_field);
+	advect(read_buffer.v, write_buffer.v, velocity_field);
+}
+
+void FluidGrid::project(VelocityField& velocity_field)
 {
 	// compute divergence
 	float h = 1.0f / m_width; // assuming square grid
-	for (int y = 0; y < m_height; ++y)
+	fillHalo(velocity_field.u, m_width, m_height);
+	fillHalo(velocity_field.v, m_width, m_height);
+	if (!m_pressure_warm_start)
+		std::fill(m_pressure.begin(), m_pressure.end(), .0f); // reset pressure, ohhh
+
+	forEachSpan([&](int y, int x_begin, int x_end)
 	{
-		for (int x = 0; x < m_width; ++x)
+		int index = haloIndex(x_begin, y, m_width);
+		m_kernels->divergenceRow(&m_divergence[index], &velocity_field.u[index], &velocity_field.v[index],
+			m_stride, x_end - x_begin, -.5f * h);
+	});
+
+	// solve for pressure
+	if (m_pressure_solver == PressureSolver::Multigrid)
+	{
+		m_last_pressure_iterations = m_multigrid->solve(m_pressure, m_divergence, *m_pool,
+			m_pressure_tolerance, m_max_pressure_cycles);
+		m_last_pressure_residual = m_multigrid->getLastResidual();
+		m_last_pressure_stalled = m_multigrid->getLastStalled();
+	}
+	else
+	{
+		m_last_pressure_stalled = false;
+
+		// Gauss-Seidel, in batches of check_interval sweeps between residual checks.
+		// a warm started solve may not need any
+		int sweeps = 0;
+		bool converged = false;
+		if (m_pressure_tolerance > 0.0f)
 		{
-			int index = IX(x, y, m_width);
-			float div =
-				(velocity_field[IX(x + 1, y, m_width)].x - velocity_field[IX(x - 1, y, m_width)].x +
-				 velocity_field[IX(x, y + 1, m_width)].y - velocity_field[IX(x, y - 1, m_width)].y);
-			m_divergence[index] = -.5f * h * div;
-			m_pressure[index] = .0f; // reset pressure, ohhh
+			m_last_pressure_residual = pressureResidual();
+			converged = m_last_pressure_residual <= m_pressure_tolerance;
 		}
-	}
 
-	// solve for pressure using Gauss-Seidel
-	int iter = 20;
-	for (int k = 0; k < iter; ++k)
-	{
-		for (int y = 0; y < m_height; ++y)
+		while (!converged && sweeps < m_max_pressure_sweeps)
 		{
-			for (int x = 0; x < m_width; ++x)
+			int batch = m_pressure_tolerance > 0.0f ? std::max(m_pressure_check_interval, 1) : m_max_pressure_sweeps;
+			batch = std::min(batch, m_max_pressure_sweeps - sweeps);
+			linearSolve(m_pressure, m_divergence, 1.0f, 4.0f, batch);
+			sweeps += batch;
+
+			if (m_pressure_tolerance > 0.0f)
 			{
-				int index = IX(x, y, m_width);
-				float neighbor_sum =
-					m_pressure[IX(x - 1, y, m_width)] +
-					m_pressure[IX(x + 1, y, m_width)] +
-					m_pressure[IX(x, y - 1, m_width)] +
-					m_pressure[IX(x, y + 1, m_width)];
-				m_pressure[index] = (m_divergence[index] + neighbor_sum) / 4.0f;
+				m_last_pressure_residual = pressureResidual();
+				converged = m_last_pressure_residual <= m_pressure_tolerance;
 			}
 		}
+
+		if (m_pressure_tolerance <= 0.0f)
+			m_last_pressure_residual = pressureResidual();
+		m_last_pressure_iterations = sweeps;
 	}
 
 	// subtract pressure gradient from velocity field
 	float inv_h = .5f / h;  // .5f*m_width
-	for (int y = 0; y < m_height; ++y)
+	fillHalo(m_pressure, m_width, m_height);
+
+	forEachSpan([&](int y, int x_begin, int x_end)
 	{
-		for (int x = 0; x < m_width; ++x)
+		int index = haloIndex(x_begin, y, m_width);
+		m_kernels->gradientRow(&velocity_field.u[index], &velocity_field.v[index], &m_pressure[index],
+			m_stride, x_end - x_begin, inv_h);
+	});
+}
+
+float FluidGrid::pressureResidual()
+{
+	fillHalo(m_pressure, m_width, m_height);
+
+	// per row partial sums added up in row order, same result for any thread count
+	m_pool->parallelFor(0, m_height, [&](int row_begin, int row_end)
+	{
+		for (int y = row_begin; y < row_end; ++y)
 		{
-			int index = IX(x, y, m_width);
-			float p_right = m_pressure[IX(x + 1, y, m_width)];
-			float p_left = m_pressure[IX(x - 1, y, m_width)];
-			float p_top = m_pressure[IX(x, y + 1, m_width)];
-			float p_bottom = m_pressure[IX(x, y - 1, m_width)];
-			
-			velocity_field[index].x -= inv_h * (p_right - p_left);
-			velocity_field[index].y -= inv_h * (p_top - p_bottom);
+			double residual_sum = 0.0;
+			double rhs_sum = 0.0;
+			int index = haloIndex(0, y, m_width);
+			for (int x = 0; x < m_width; ++x, ++index)
+			{
+				float neighbor_sum =
+					m_pressure[index - 1] +
+					m_pressure[index + 1] +
+					m_pressure[index - m_stride] +
+					m_pressure[index + m_stride];
+				double b = m_divergence[index];
+				double r = b - (4.0f * m_pressure[index] - neighbor_sum);
+				residual_sum += r * r;
+				rhs_sum += b * b;
+			}
+			m_residual_row_sums[2 * y] = residual_sum;
+			m_residual_row_sums[2 * y + 1] = rhs_sum;
 		}
+	});
+
+	double residual_total = 0.0;
+	double rhs_total = 0.0;
+	for (int y = 0; y < m_height; ++y)
+	{
+		residual_total += m_residual_row_sums[2 * y];
+		rhs_total += m_residual_row_sums[2 * y + 1];
 	}
+
+	// nothing to solve
+	if (rhs_total <= 0.0)
+		return 0.0f;
+
+	return (float)std::sqrt(residual_total / rhs_total);
 }
 
-void FluidGrid::setBoundaries(std::vector<glm::vec2>& field)
+void FluidGrid::setBoundaries(VelocityField& field)
 {
 	// no-slip
 
 	// left and right
 	for (int y = 0; y < m_height; ++y)
 	{
-		field[IX(0, y, m_width)] = glm::vec2(0.0f);
-		field[IX(m_width - 1, y, m_width)] = glm::vec2(0.0f);
+		int left = haloIndex(0, y, m_width);
+		int right = haloIndex(m_width - 1, y, m_width);
+		field.u[left] = field.v[left] = 0.0f;
+		field.u[right] = field.v[right] = 0.0f;
 	}
 
 	// top and bottom walls
 	for (int x = 0; x < m_width; ++x)
 	{
-		field[IX(x, 0, m_width)] = glm::vec2(0.0f);
-		field[IX(x, m_height - 1, m_width)] = glm::vec2(0.0f);
+		int bottom = haloIndex(x, 0, m_width);
+		int top = haloIndex(x, m_height - 1, m_width);
+		field.u[bottom] = field.v[bottom] = 0.0f;
+		field.u[top] = field.v[top] = 0.0f;
 	}
 }
-//void FluidGrid::setBoundaries(std::vector<glm::vec2>& field)
+//void FluidGrid::setBoundaries(VelocityField& field)
 //{
 //	// edges
 //	// left and right
 //	for (int y = 0; y < m_height; ++y)
 //	{
-//		field[IX(0, y, m_width)].x = .0f;
-//		field[IX(m_width - 1, y, m_width)].x = .0f;
+//		field.u[haloIndex(0, y, m_width)] = .0f;
+//		field.u[haloIndex(m_width - 1, y, m_width)] = .0f;
 //	}
 //
 //	// top and bottom
 //	for (int x = 0; x < m_width; ++x)
 //	{
-//		field[IX(x, 0, m_width)].y = .0f;
-//		field[IX(x, m_height - 1, m_width)].y = .0f;
+//		field.v[haloIndex(x, 0, m_width)] = .0f;
+//		field.v[haloIndex(x, m_height - 1, m_width)] = .0f;
 //	}
 //
 //	// corners
-//	field[IX(0, 0, m_width)] = glm::vec2(.0f);
-//	field[IX(0, m_height - 1, m_width)] = glm::vec2(.0f);
-//	field[IX(m_width - 1, 0, m_width)] = glm::vec2(.0f);
-//	field[IX(m_width - 1, m_height - 1, m_width)] = glm::vec2(.0f);
+//	for (int index : { haloIndex(0, 0, m_width), haloIndex(0, m_height - 1, m_width),
+//		haloIndex(m_width - 1, 0, m_width), haloIndex(m_width - 1, m_height - 1, m_width) })
+//	{
+//		field.u[index] = field.v[index] = .0f;
+//	}
 //}
 
+float FluidGrid::computeMaxVelocity()
+{
+	m_pool->parallelFor(0, m_height, [&](int row_begin, int row_end)
+	{
+		for (int y = row_begin; y < row_end; ++y)
+		{
+			// sleeping tiles are 0
+			float row_max = 0.0f;
+			for (const glm::ivec2& span : m_tile_spans[y / k_tile_size])
+			{
+				int index = haloIndex(span.x, y, m_width);
+				for (int x = span.x; x < span.y; ++x, ++index)
+				{
+					float u = m_velocity_read.u[index];
+					float v = m_velocity_read.v[index];
+					row_max = std::max(row_max, u * u + v * v);
+				}
+			}
+			m_row_max_velocity[y] = row_max;
+		}
+	});
+
+	float max_squared = 0.0f;
+	for (float row_max : m_row_max_velocity)
+		max_squared = std::max(max_squared, row_max);
+	return std::sqrt(max_squared);
+}
+
 void FluidGrid::step()
 {
+	int substeps = 1;
+	if (m_target_cfl > 0.0f)
+	{
+		// cells the fastest cell moves in a full step, nan / inf get the max
+		float cells = computeMaxVelocity() * m_delta_time;
+		if (cells <= m_target_cfl * m_max_substeps)
+			substeps = std::max(1, (int)std::ceil(cells / m_target_cfl));
+		else
+			substeps = std::max(m_max_substeps, 1);
+	}
+	m_last_substeps = substeps;
+
+	float dt = m_delta_time;
+	m_delta_time = dt / substeps;
+	for (int i = 0; i < substeps; ++i)
+		substep();
+	m_delta_time = dt;
+}
+
+void FluidGrid::substep()
+{
+	applyEmitters();
+
 	m_global_force = glm::vec2(.0f, .5f);
-	for (int i = 0; i < m_velocity_read.size(); ++i)
+	glm::vec2 impulse = m_global_force * m_delta_time;
+	if (m_active_tiles)
 	{
-		m_velocity_read[i] += m_global_force * m_delta_time;
+		// nothing awake, nothing can change
+		updateActiveTiles();
+		if (m_awake_tile_count == 0)
+			return;
+
+		// awake tiles only, a sleeping tile has to stay 0
+		forEachSpan([&](int y, int x_begin, int x_end)
+		{
+			int index = haloIndex(x_begin, y, m_width);
+			for (int x = x_begin; x < x_end; ++x, ++index)
+			{
+				m_velocity_read.u[index] += impulse.x;
+				m_velocity_read.v[index] += impulse.y;
+			}
+		});
+	}
+	else
+	{
+		for (int i = 0; i < (int)m_velocity_read.u.size(); ++i)
+		{
+			m_velocity_read.u[i] += impulse.x;
+			m_velocity_read.v[i] += impulse.y;
+		}
 	}
 	
 	// diff velocity
@@ -1,43 +1,187 @@
 #pragma once
 #include <vector>
+#include <memory>
+#include <functional>
 #include <glm/glm.hpp>
+#include "ThreadPool.h"
+#include "Multigrid.h"
+#include "AlignedAllocator.h"
+#include "FluidKernels.h"
+#include "Emitter.h"
+
+// velocity as separate u / v planes (structure of arrays)
+struct VelocityField
+{
+	FloatPlane u;
+	FloatPlane v;
+};
 
 class FluidGrid
 {
 public:
+	enum class PressureSolver
+	{
+		GaussSeidel, // fixed 20 red-black sweeps
+		Multigrid    // V-cycles until the residual tolerance is met
+	};
+
 	FluidGrid(int width, int height);
+	~FluidGrid();
 
+	// one step of the grid's dt, split into cfl substeps when a target cfl is set
 	void step();
 
 	void addDensity(int x, int y, float amount);
 	void addVelocity(int x, int y, float forceX, float forceY);
 
-	const std::vector<float>& getDensity() { return m_density_read; }
-	const std::vector<glm::vec2>& getVelocity() { return m_velocity_read; }
-	const std::vector<float>& getPressure() { return m_pressure; }
+	// the same emitters as GpuGrid3D, applied at the start of every substep (rate * dt).
+	// the grid is the z = position.z slice through each emitter, force.z is dropped
+	void setEmitters(const std::vector<Emitter>& emitters) { m_emitters = emitters; }
+	const std::vector<Emitter>& getEmitters() const { return m_emitters; }
+
+	// fields are stored with a one cell halo, see GridHalo.h.
+	// cell (x, y) is at (x + 1) + (y + 1) * getStride()
+	int getStride() const { return m_stride; }
+
+	const FloatPlane& getDensity() { return m_density_read; }
+	const FloatPlane& getVelocityX() { return m_velocity_read.u; }
+	const FloatPlane& getVelocityY() { return m_velocity_read.v; }
+	const FloatPlane& getPressure() { return m_pressure; }
+
+	// solver threads, results are bit-identical for any count
+	void setThreadCount(int thread_count);
+	int getThreadCount() const { return m_pool->getThreadCount(); }
+
+	// pressure solve, multigrid by default. gauss-seidel kept for A/B runs
+	void setPressureSolver(PressureSolver solver) { m_pressure_solver = solver; }
+	PressureSolver getPressureSolver() const { return m_pressure_solver; }
+
+	// both solvers stop once ||r|| <= tolerance * ||divergence||, 0 runs the full count
+	void setPressureTolerance(float tolerance) { m_pressure_tolerance = tolerance; }
+	void setMaxPressureCycles(int max_cycles) { m_max_pressure_cycles = max_cycles; }
+
+	// gauss-seidel: at most max_sweeps red-black sweeps, residual checked every check_interval
+	void setMaxPressureSweeps(int max_sweeps) { m_max_pressure_sweeps = max_sweeps; }
+	void setPressureCheckInterval(int check_interval) { m_pressure_check_interval = check_interval; }
+
+	// red-black gauss-seidel sweeps per diffuse solve (density and each velocity plane)
+	void setDiffuseIterations(int iterations) { m_diffuse_iterations = iterations; }
+	int getDiffuseIterations() const { return m_diffuse_iterations; }
+
+	// cfl substepping: step() runs as many substeps of dt / n as it takes for no cell to move
+	// more than target_cfl cells per substep, at most max_substeps. 0 turns it off (one step)
+	void setTargetCfl(float target_cfl, int max_substeps = 8) { m_target_cfl = target_cfl; m_max_substeps = max_substeps; }
+	int getLastSubsteps() const { return m_last_substeps; }
+
+	// max |velocity| in cells per unit time, reduced per row over the solver threads
+	float computeMaxVelocity();
+
+	// start each solve from last step's pressure instead of zero
+	void setPressureWarmStart(bool warm_start) { m_pressure_warm_start = warm_start; }
+	bool getPressureWarmStart() const { return m_pressure_warm_start; }
+
+	// V-cycles (multigrid) or sweeps (gauss-seidel) and relative residual of the last solve
+	int getLastPressureIterations() const { return m_last_pressure_iterations; }
+	float getLastPressureResidual() const { return m_last_pressure_residual; }
+	// multigrid stopped at float precision with the residual still above tolerance
+	bool getLastPressureStalled() const { return m_last_pressure_stalled; }
+
+	// active tiles: the grid is split into k_tile_size^2 tiles, awake when they or a neighbour
+	// hold density above threshold (or were written by addDensity / addVelocity). velocity alone
+	// doesn't keep a tile awake, the global force would never let anything sleep.
+	// advect, diffuse, divergence, gradient and the global force only visit awake tiles,
+	// sleeping tiles are kept at 0 (velocity too) and a substep with nothing awake is skipped.
+	// the pressure solve still covers the whole grid. off by default
+	void setActiveTiles(bool enabled, float threshold = 1e-4f);
+	bool getActiveTiles() const { return m_active_tiles; }
+	int getAwakeTileCount() const { return m_awake_tile_count; }
+	int getTileCount() const { return m_tiles_x * m_tiles_y; }
+	static const int k_tile_size = 16;
+
+	// stencil kernels, picked from the cpu at construction. scalar is the reference
+	// the simd variants are validated against. returns false if the cpu can't run isa
+	bool setKernelIsa(KernelIsa isa);
+	KernelIsa getKernelIsa() const { return m_kernel_isa; }
 
 private:
 	int m_width;
 	int m_height;
+	int m_stride; // width + 2 halo cells
 	float m_delta_time;
 	float m_viscosity;
 	glm::vec2 m_global_force;
+	int m_diffuse_iterations;
 
 	void swapBuffers();
-	void advect(std::vector<float>& read_buffer, std::vector<float>& write_buffer, const std::vector<glm::vec2>& velocity_field);
-	void diffuse(std::vector<float>& read_buffer, std::vector<float>& write_buffer, float diff_rate);
-	void diffuseVelocity(const std::vector<glm::vec2>& read_buffer, std::vector<glm::vec2>& write_buffer, float diff_rate);
-	void advectVelocity(const std::vector<glm::vec2>& read_buffer, std::vector<glm::vec2>& write_buffer, const std::vector<glm::vec2>& velocity_field);
-	void project(std::vector<glm::vec2>& velocity_field);
-	void setBoundaries(std::vector<glm::vec2>& field);
+	void substep();
+	void applyEmitters();
+
+	// cells [x_begin, x_end) of row y for every run of awake tiles (the whole row with the
+	// tiles off), rows split over the solver threads like everywhere else
+	void forEachSpan(const std::function<void(int y, int x_begin, int x_end)>& body);
+
+	// content flags, dilation, zeroes the tiles that fall asleep, rebuilds the spans
+	void updateActiveTiles();
+	int tileIndex(int x, int y) const;
+	bool tileHasContent(int tile_x, int tile_y) const;
+	void clearTile(int tile_x, int tile_y);
+	void resetTileSpans();
+	void advect(FloatPlane& read_buffer, FloatPlane& write_buffer, const VelocityField& velocity_field);
+	void diffuse(FloatPlane& read_buffer, FloatPlane& write_buffer, float diff_rate);
+	void diffuseVelocity(const VelocityField& read_buffer, VelocityField& write_buffer, float diff_rate);
+	void advectVelocity(VelocityField& read_buffer, VelocityField& write_buffer, const VelocityField& velocity_field);
+	void project(VelocityField& velocity_field);
+	void setBoundaries(VelocityField& field);
+
+	// red-black Gauss-Seidel for v = (v0 + a * neighbor_sum) / c
+	void linearSolve(FloatPlane& v, const FloatPlane& v0, float a, float c, int iterations);
+
+	// ||divergence - (4p - neighbor_sum)|| / ||divergence||
+	float pressureResidual();
+
+	const FluidKernels* m_kernels;
+	KernelIsa m_kernel_isa;
+
+	std::unique_ptr<ThreadPool> m_pool;
+
+	// pressure solver
+	PressureSolver m_pressure_solver;
+	float m_pressure_tolerance;
+	int m_max_pressure_cycles;
+	int m_max_pressure_sweeps;
+	int m_pressure_check_interval;
+	bool m_pressure_warm_start;
+	int m_last_pressure_iterations;
+	float m_last_pressure_residual;
+	bool m_last_pressure_stalled;
+	std::vector<double> m_residual_row_sums; // per row r^2, rhs^2
+
+	// cfl substeps
+	float m_target_cfl;
+	int m_max_substeps;
+	int m_last_substeps;
+	std::vector<float> m_row_max_velocity;
+	std::unique_ptr<Multigrid> m_multigrid;
+
+	// active tiles
+	bool m_active_tiles;
+	float m_tile_threshold;
+	int m_tiles_x, m_tiles_y;
+	int m_awake_tile_count;
+	std::vector<unsigned char> m_tile_content; // above the threshold this substep
+	std::vector<unsigned char> m_tile_awake;
+	std::vector<unsigned char> m_tile_touched; // by addDensity / addVelocity since the last substep
+	std::vector<std::vector<glm::ivec2>> m_tile_spans; // per row of tiles, [x_begin, x_end) runs of awake tiles
+
+	std::vector<Emitter> m_emitters;
 
 	// sim data
-	std::vector<float> m_density_read;
-	std::vector<float> m_density_write;
-	std::vector<glm::vec2> m_velocity_read;
-	std::vector<glm::vec2> m_velocity_write;
+	FloatPlane m_density_read;
+	FloatPlane m_density_write;
+	VelocityField m_velocity_read;
+	VelocityField m_velocity_write;
 
 	// projection buffers
-	std::vector<float> m_divergence;
-	std::vector<float> m_pressure;
+	FloatPlane m_divergence;
+	FloatPlane m_pressure;
 };
\ No newline at end of file
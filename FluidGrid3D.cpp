@@ -0,0 +1,314 @@
+#include "FluidGrid3D.h"
+#include "GridHalo.h"
+#include <thread>
+#include <algorithm>
+#include <cmath>
+
+FluidGrid3D::FluidGrid3D(int width, int height, int depth)
+	: m_width(width), m_height(height), m_depth(depth),
+	m_pressure_warm_start(true), m_pressure_tolerance(0.0f), m_pressure_check_interval(4),
+	m_last_pressure_iterations(0), m_last_pressure_residual(0.0f)
+{
+	// interior + one cell halo
+	m_stride_y = width + 2;
+	m_stride_z = (width + 2) * (height + 2);
+	int size = m_stride_z * (depth + 2);
+
+	for (FloatPlane* plane : { &m_density, &m_velocity.u, &m_velocity.v, &m_velocity.w,
+		&m_divergence, &m_pressure, &m_temp, &m_rhs,
+		&m_velocity_temp.u, &m_velocity_temp.v, &m_velocity_temp.w })
+	{
+		plane->resize(size, 0.0f);
+	}
+	m_residual_row_sums.resize(2 * height * depth, 0.0);
+
+	setThreadCount((int)std::thread::hardware_concurrency());
+}
+
+FluidGrid3D::~FluidGrid3D() = default;
+
+void FluidGrid3D::setThreadCount(int thread_count)
+{
+	if (thread_count < 1) thread_count = 1;
+	m_pool = std::make_unique<ThreadPool>(thread_count);
+}
+
+void FluidGrid3D::clear()
+{
+	for (FloatPlane* plane : { &m_density, &m_velocity.u, &m_velocity.v, &m_velocity.w,
+		&m_divergence, &m_pressure })
+	{
+		std::fill(plane->begin(), plane->end(), 0.0f);
+	}
+}
+
+template <typename Body>
+void FluidGrid3D::forEachCell(const Body& body)
+{
+	// one job per (y, z) row, x stays the inner loop
+	m_pool->parallelFor(0, m_height * m_depth, [&](int row_begin, int row_end)
+	{
+		for (int row = row_begin; row < row_end; ++row)
+		{
+			int y = row % m_height;
+			int z = row / m_height;
+			int index = haloIndex3D(0, y, z, m_width, m_height);
+			for (int x = 0; x < m_width; ++x, ++index)
+				body(index, x, y, z);
+		}
+	});
+}
+
+void FluidGrid3D::splat(const glm::vec3& brush_center3D, float radius, const glm::vec3& force)
+{
+	// splat.comp: velocity += force * w, density += w, w = exp(-dist / radius).
+	// the gpu runs it once per field, the weight is the same so do both here
+	forEachCell([&](int index, int x, int y, int z)
+	{
+		float dist = glm::distance(glm::vec3((float)x, (float)y, (float)z), brush_center3D);
+		float splat = std::exp(-dist / radius);
+
+		m_velocity.u[index] += force.x * splat;
+		m_velocity.v[index] += force.y * splat;
+		m_velocity.w[index] += force.z * splat;
+		m_density[index] += splat;
+	});
+}
+
+void FluidGrid3D::jacobi(FloatPlane& x, const FloatPlane& b, float alpha, float r_beta, int iterations)
+{
+	// diffuse.comp / pressure.comp: x_new = (b + alpha * neighbor_sum) * r_beta,
+	// reads only the previous iterate so cells are independent
+	int stride_y = m_stride_y;
+	int stride_z = m_stride_z;
+
+	for (int k = 0; k < iterations; ++k)
+	{
+		forEachCell([&](int index, int, int, int)
+		{
+			float neighbor_sum =
+				x[index - 1] +         // left
+				x[index + 1] +         // right
+				x[index - stride_y] +  // down
+				x[index + stride_y] +  // up
+				x[index - stride_z] +  // back
+				x[index + stride_z];   // front
+
+			m_temp[index] = (b[index] + alpha * neighbor_sum) * r_beta;
+		});
+
+		// halo of m_temp is never written, stays zero
+		std::swap(x, m_temp);
+	}
+}
+
+void FluidGrid3D::diffuse(FloatPlane& field, float alpha, float r_beta, int iterations)
+{
+	// rhs is the field before diffusion.
+	// (GpuGrid3D binds u_b to the A texture, which the odd iterations overwrite)
+	m_rhs = field;
+	jacobi(field, m_rhs, alpha, r_beta, iterations);
+}
+
+void FluidGrid3D::divergence()
+{
+	float h = 1.0f / m_width;
+	int stride_y = m_stride_y;
+	int stride_z = m_stride_z;
+
+	forEachCell([&](int index, int, int, int)
+	{
+		float vel_right = m_velocity.u[index + 1];
+		float vel_left = m_velocity.u[index - 1];
+		float vel_up = m_velocity.v[index + stride_y];
+		float vel_down = m_velocity.v[index - stride_y];
+		float vel_front = m_velocity.w[index + stride_z];
+		float vel_back = m_velocity.w[index - stride_z];
+
+		m_divergence[index] = -0.5f * h * (vel_right - vel_left + vel_up - vel_down + vel_front - vel_back);
+	});
+}
+
+float FluidGrid3D::pressureResidual()
+{
+	// 6p - neighbor_sum = divergence, same stencil as pressure.comp / residual.comp
+	int stride_y = m_stride_y;
+	int stride_z = m_stride_z;
+
+	m_pool->parallelFor(0, m_height * m_depth, [&](int row_begin, int row_end)
+	{
+		for (int row = row_begin; row < row_end; ++row)
+		{
+			double residual_sum = 0.0;
+			double rhs_sum = 0.0;
+			int index = haloIndex3D(0, row % m_height, row / m_height, m_width, m_height);
+			for (int x = 0; x < m_width; ++x, ++index)
+			{
+				float neighbor_sum =
+					m_pressure[index - 1] +
+					m_pressure[index + 1] +
+					m_pressure[index - stride_y] +
+					m_pressure[index + stride_y] +
+					m_pressure[index - stride_z] +
+					m_pressure[index + stride_z];
+				double b = m_divergence[index];
+				double r = b - (6.0f * m_pressure[index] - neighbor_sum);
+				residual_sum += r * r;
+				rhs_sum += b * b;
+			}
+			m_residual_row_sums[2 * row] = residual_sum;
+			m_residual_row_sums[2 * row + 1] = rhs_sum;
+		}
+	});
+
+	// rows added up in order, same result for any thread count
+	double residual_total = 0.0;
+	double rhs_total = 0.0;
+	for (int row = 0; row < m_height * m_depth; ++row)
+	{
+		residual_total += m_residual_row_sums[2 * row];
+		rhs_total += m_residual_row_sums[2 * row + 1];
+	}
+
+	// nothing to solve
+	if (rhs_total <= 0.0)
+		return 0.0f;
+
+	return (float)std::sqrt(residual_total / rhs_total);
+}
+
+void FluidGrid3D::solvePressure(int max_iterations)
+{
+	// cold start from zero, the first jacobi iterate is then divergence / 6 (same as the gpu)
+	if (!m_pressure_warm_start)
+		std::fill(m_pressure.begin(), m_pressure.end(), 0.0f);
+
+	if (m_pressure_tolerance <= 0.0f)
+	{
+		jacobi(m_pressure, m_divergence, 1.0f, 1.0f / 6.0f, max_iterations);
+		m_last_pressure_iterations = max_iterations;
+		m_last_pressure_residual = pressureResidual();
+		return;
+	}
+
+	// batches of check_interval iterations between residual checks,
+	// a warm started solve may not need any
+	int iterations = 0;
+	m_last_pressure_residual = pressureResidual();
+	while (m_last_pressure_residual > m_pressure_tolerance && iterations < max_iterations)
+	{
+		int batch = std::min(std::max(m_pressure_check_interval, 1), max_iterations - iterations);
+		jacobi(m_pressure, m_divergence, 1.0f, 1.0f / 6.0f, batch);
+		iterations += batch;
+		m_last_pressure_residual = pressureResidual();
+	}
+	m_last_pressure_iterations = iterations;
+}
+
+void FluidGrid3D::gradient()
+{
+	float h = 1.0f / m_width;
+	float inv_h = 0.5f / h;
+	int stride_y = m_stride_y;
+	int stride_z = m_stride_z;
+
+	// only reads pressure, safe in place
+	forEachCell([&](int index, int, int, int)
+	{
+		m_velocity.u[index] -= inv_h * (m_pressure[index + 1] - m_pressure[index - 1]);
+		m_velocity.v[index] -= inv_h * (m_pressure[index + stride_y] - m_pressure[index - stride_y]);
+		m_velocity.w[index] -= inv_h * (m_pressure[index + stride_z] - m_pressure[index - stride_z]);
+	});
+}
+
+float FluidGrid3D::sample(const FloatPlane& field, float x, float y, float z) const
+{
+	// texture() on a GL_LINEAR / GL_CLAMP_TO_EDGE sampler: texel centres sit at +.5
+	x -= .5f;
+	y -= .5f;
+	z -= .5f;
+
+	float fx = std::floor(x);
+	float fy = std::floor(y);
+	float fz = std::floor(z);
+	float sx = x - fx;
+	float sy = y - fy;
+	float sz = z - fz;
+
+	int x0 = std::min(std::max((int)fx, 0), m_width - 1);
+	int y0 = std::min(std::max((int)fy, 0), m_height - 1);
+	int z0 = std::min(std::max((int)fz, 0), m_depth - 1);
+	int x1 = std::min(std::max((int)fx + 1, 0), m_width - 1);
+	int y1 = std::min(std::max((int)fy + 1, 0), m_height - 1);
+	int z1 = std::min(std::max((int)fz + 1, 0), m_depth - 1);
+
+	float c000 = field[haloIndex3D(x0, y0, z0, m_width, m_height)];
+	float c100 = field[haloIndex3D(x1, y0, z0, m_width, m_height)];
+	float c010 = field[haloIndex3D(x0, y1, z0, m_width, m_height)];
+	float c110 = field[haloIndex3D(x1, y1, z0, m_width, m_height)];
+	float c001 = field[haloIndex3D(x0, y0, z1, m_width, m_height)];
+	float c101 = field[haloIndex3D(x1, y0, z1, m_width, m_height)];
+	float c011 = field[haloIndex3D(x0, y1, z1, m_width, m_height)];
+	float c111 = field[haloIndex3D(x1, y1, z1, m_width, m_height)];
+
+	float c00 = c000 + sx * (c100 - c000);
+	float c10 = c010 + sx * (c110 - c010);
+	float c01 = c001 + sx * (c101 - c001);
+	float c11 = c011 + sx * (c111 - c011);
+
+	float c0 = c00 + sy * (c10 - c00);
+	float c1 = c01 + sy * (c11 - c01);
+
+	return c0 + sz * (c1 - c0);
+}
+
+void FluidGrid3D::advect(const FloatPlane& src, FloatPlane& dst, float dt)
+{
+	// advect.comp: backtrace from the texel coord (no +.5, like the shader) with the current velocity
+	forEachCell([&](int index, int x, int y, int z)
+	{
+		float prev_x = (float)x - m_velocity.u[index] * dt;
+		float prev_y = (float)y - m_velocity.v[index] * dt;
+		float prev_z = (float)z - m_velocity.w[index] * dt;
+
+		dst[index] = sample(src, prev_x, prev_y, prev_z);
+	});
+}
+
+void FluidGrid3D::step(const glm::vec3& brush_center3D, const glm::vec3& brush_force,
+	bool is_bouncing, float dt,
+	float viscosity, int diffuse_iterations, int pressure_iterations)
+{
+	// splat
+	if (is_bouncing)
+	{
+		float brush_radius = m_width * 0.025f; // 2.5% of the obj
+		splat(brush_center3D, brush_radius, brush_force);
+	}
+
+	// diffuse
+	float vel_a = dt * viscosity * m_width * m_width;
+	float vel_rBeta = 1.0f / (1.0f + 6.0f * vel_a);
+
+	float dens_a = dt * 0.00001f * m_width * m_width; // diff for smoke
+	float dens_rBeta = 1.0f / (1.0f + 6.0f * dens_a);
+
+	diffuse(m_velocity.u, vel_a, vel_rBeta, diffuse_iterations);
+	diffuse(m_velocity.v, vel_a, vel_rBeta, diffuse_iterations);
+	diffuse(m_velocity.w, vel_a, vel_rBeta, diffuse_iterations);
+	diffuse(m_density, dens_a, dens_rBeta, diffuse_iterations);
+
+	// divergence, pressure, gradient
+	divergence();
+	solvePressure(pressure_iterations);
+	gradient();
+
+	// advect velocity by itself, then density by the new velocity
+	advect(m_velocity.u, m_velocity_temp.u, dt);
+	advect(m_velocity.v, m_velocity_temp.v, dt);
+	advect(m_velocity.w, m_velocity_temp.w, dt);
+	std::swap(m_velocity, m_velocity_temp);
+
+	advect(m_density, m_temp, dt);
+	std::swap(m_density, m_temp);
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include <glm/glm.hpp>
+#include "ThreadPool.h"
+#include "AlignedAllocator.h"
+
+struct VelocityField3D
+{
+	FloatPlane u;
+	FloatPlane v;
+	FloatPlane w;
+};
+
+// CPU version of GpuGrid3D for machines without a GL context (batch runs, validating the gpu path).
+// same stages in the same order with the same parameters as GpuGrid3D::step:
+// splat, jacobi diffuse, divergence, jacobi pressure, gradient, advect
+class FluidGrid3D
+{
+public:
+	FluidGrid3D(int width, int height, int depth);
+	~FluidGrid3D();
+
+	void step(const glm::vec3& brush_center3D, const glm::vec3& brush_force,
+		bool is_bouncing, float dt,
+		float viscosity, int diffuse_iterations, int pressure_iterations);
+
+	void clear();
+
+	// solver threads, results are bit-identical for any count
+	void setThreadCount(int thread_count);
+	int getThreadCount() const { return m_pool->getThreadCount(); }
+
+	// start each pressure solve from last step's pressure (the gpu default) instead of zero
+	void setPressureWarmStart(bool warm_start) { m_pressure_warm_start = warm_start; }
+	bool getPressureWarmStart() const { return m_pressure_warm_start; }
+
+	// stop the pressure iterations once ||r|| <= tolerance * ||divergence||, checked every
+	// check_interval iterations. 0 runs the full pressure_iterations like before
+	void setPressureTolerance(float tolerance) { m_pressure_tolerance = tolerance; }
+	void setPressureCheckInterval(int check_interval) { m_pressure_check_interval = check_interval; }
+
+	// jacobi iterations and relative residual of the last pressure solve
+	int getLastPressureIterations() const { return m_last_pressure_iterations; }
+	float getLastPressureResidual() const { return m_last_pressure_residual; }
+
+	int getWidth() const { return m_width; }
+	int getHeight() const { return m_height; }
+	int getDepth() const { return m_depth; }
+
+	// fields have a one cell halo (haloIndex3D in GridHalo.h) that stays zero,
+	// same as texelFetch outside the texture on the gpu
+	const FloatPlane& getDensity() const { return m_density; }
+	const FloatPlane& getVelocityX() const { return m_velocity.u; }
+	const FloatPlane& getVelocityY() const { return m_velocity.v; }
+	const FloatPlane& getVelocityZ() const { return m_velocity.w; }
+	const FloatPlane& getPressure() const { return m_pressure; }
+
+private:
+	int m_width, m_height, m_depth;
+	int m_stride_y; // width + 2
+	int m_stride_z; // (width + 2) * (height + 2)
+
+	std::unique_ptr<ThreadPool> m_pool;
+
+	// pressure solve
+	bool m_pressure_warm_start;
+	float m_pressure_tolerance;
+	int m_pressure_check_interval;
+	int m_last_pressure_iterations;
+	float m_last_pressure_residual;
+	std::vector<double> m_residual_row_sums; // per row r^2, rhs^2
+
+	// sim data
+	FloatPlane m_density;
+	VelocityField3D m_velocity;
+
+	// projection
+	FloatPlane m_divergence;
+	FloatPlane m_pressure;
+
+	// scratch: jacobi ping-pong, diffusion rhs, advection target
+	FloatPlane m_temp;
+	FloatPlane m_rhs;
+	VelocityField3D m_velocity_temp;
+
+	// run body(index, x, y, z) over the interior, split by rows across the pool
+	template <typename Body>
+	void forEachCell(const Body& body);
+
+	void splat(const glm::vec3& brush_center3D, float radius, const glm::vec3& force);
+	void jacobi(FloatPlane& x, const FloatPlane& b, float alpha, float r_beta, int iterations);
+	void diffuse(FloatPlane& field, float alpha, float r_beta, int iterations);
+	void divergence();
+	void solvePressure(int max_iterations);
+	float pressureResidual();
+	void gradient();
+	void advect(const FloatPlane& src, FloatPlane& dst, float dt);
+	float sample(const FloatPlane& field, float x, float y, float z) const;
+};
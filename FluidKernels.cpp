@@ -0,0 +1,165 @@
+#include "FluidKernels.h"
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define FLUID_KERNELS_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// scalar reference
+
+static void relaxRowScalar(float* v, const float* v0, int stride, int width, int first_x, float a, float c)
+{
+	for (int x = first_x; x < width; x += 2)
+	{
+		float neighbor_sum = v[x - 1] + v[x + 1] + v[x - stride] + v[x + stride];
+		v[x] = (v0[x] + a * neighbor_sum) / c;
+	}
+}
+
+static void divergenceRowScalar(float* div, const float* u, const float* v, int stride, int width, float scale)
+{
+	for (int x = 0; x < width; ++x)
+	{
+		div[x] = scale * (u[x + 1] - u[x - 1] + v[x + stride] - v[x - stride]);
+	}
+}
+
+static void gradientRowScalar(float* u, float* v, const float* p, int stride, int width, float scale)
+{
+	for (int x = 0; x < width; ++x)
+	{
+		u[x] -= scale * (p[x + 1] - p[x - 1]);
+		v[x] -= scale * (p[x + stride] - p[x - stride]);
+	}
+}
+
+static void advectRowScalar(float* dst, const float* src, const float* u, const float* v,
+	int y, int x_begin, int x_end, int width, int height, float dt)
+{
+	int stride = width + 2;
+	float max_x = (float)(width - 1);
+	float max_y = (float)(height - 1);
+
+	for (int x = x_begin; x < x_end; ++x)
+	{
+		// back to the future, clamped so the 2x2 footprint stays inside interior + halo
+		float prev_x = ((float)x + .5f) - u[x] * dt;
+		float prev_y = ((float)y + .5f) - v[x] * dt;
+		prev_x = std::min(std::max(prev_x, 0.0f), max_x);
+		prev_y = std::min(std::max(prev_y, 0.0f), max_y);
+
+		int x0 = (int)prev_x;
+		int y0 = (int)prev_y;
+		float sx = prev_x - (float)x0;
+		float sy = prev_y - (float)y0;
+
+		int index = (x0 + 1) + (y0 + 1) * stride;
+		float v00 = src[index];
+		float v10 = src[index + 1];
+		float v01 = src[index + stride];
+		float v11 = src[index + stride + 1];
+
+		float top = v00 + sx * (v10 - v00);
+		float bottom = v01 + sx * (v11 - v01);
+		dst[x] = top + sy * (bottom - top);
+	}
+}
+
+const FluidKernels* getScalarFluidKernels()
+{
+	static const FluidKernels kernels = {
+		"scalar",
+		relaxRowScalar,
+		divergenceRowScalar,
+		gradientRowScalar,
+		advectRowScalar
+	};
+	return &kernels;
+}
+
+// runtime dispatch
+
+#if FLUID_KERNELS_X86
+static void cpuid(int leaf, int subleaf, unsigned int regs[4])
+{
+#if defined(_MSC_VER)
+	int r[4];
+	__cpuidex(r, leaf, subleaf);
+	for (int i = 0; i < 4; ++i) regs[i] = (unsigned int)r[i];
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static unsigned long long xgetbv0()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	unsigned int eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+#endif
+
+KernelIsa detectKernelIsa()
+{
+#if FLUID_KERNELS_X86
+	unsigned int regs[4];
+	cpuid(0, 0, regs);
+	unsigned int max_leaf = regs[0];
+
+	cpuid(1, 0, regs);
+	bool osxsave = (regs[2] & (1u << 27)) != 0;
+	bool avx = (regs[2] & (1u << 28)) != 0;
+	if (!osxsave || !avx || max_leaf < 7)
+		return KernelIsa::Scalar;
+
+	// os has to save the ymm (and zmm) state on context switches
+	unsigned long long xcr0 = xgetbv0();
+	bool ymm_state = (xcr0 & 0x6) == 0x6;
+	bool zmm_state = (xcr0 & 0xe6) == 0xe6;
+
+	cpuid(7, 0, regs);
+	bool avx2 = (regs[1] & (1u << 5)) != 0;
+	bool avx512f = (regs[1] & (1u << 16)) != 0;
+
+	if (avx512f && zmm_state && getAvx512FluidKernels())
+		return KernelIsa::Avx512;
+	if (avx2 && ymm_state && getAvx2FluidKernels())
+		return KernelIsa::Avx2;
+#endif
+	return KernelIsa::Scalar;
+}
+
+const FluidKernels* getFluidKernels(KernelIsa isa)
+{
+	static const KernelIsa best = detectKernelIsa();
+
+	// isas are ordered, anything up to the detected one runs here
+	if ((int)isa > (int)best)
+		return nullptr;
+
+	switch (isa)
+	{
+	case KernelIsa::Avx512: return getAvx512FluidKernels();
+	case KernelIsa::Avx2: return getAvx2FluidKernels();
+	default: return getScalarFluidKernels();
+	}
+}
+
+const char* kernelIsaName(KernelIsa isa)
+{
+	switch (isa)
+	{
+	case KernelIsa::Avx512: return "avx512";
+	case KernelIsa::Avx2: return "avx2";
+	default: return "scalar";
+	}
+}
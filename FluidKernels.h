@@ -0,0 +1,47 @@
+#pragma once
+
+// row kernels for the CPU FluidGrid. every kernel works on the interior cells
+// x = [0, width) of one halo padded row (see GridHalo.h): row pointers point at
+// interior cell 0, so x - 1 / x + width are halo cells and +-stride are the rows
+// above and below. all variants do the same float ops in the same order, so
+// the SIMD kernels match the scalar reference bit for bit
+struct FluidKernels
+{
+	const char* name;
+
+	// red-black Gauss-Seidel for the cells x = first_x, first_x + 2, ...
+	// v = (v0 + a * (left + right + bottom + top)) / c
+	void (*relaxRow)(float* v, const float* v0, int stride, int width, int first_x, float a, float c);
+
+	// div = scale * (u_right - u_left + v_top - v_bottom)
+	void (*divergenceRow)(float* div, const float* u, const float* v, int stride, int width, float scale);
+
+	// u -= scale * (p_right - p_left), v -= scale * (p_top - p_bottom)
+	void (*gradientRow)(float* u, float* v, const float* p, int stride, int width, float scale);
+
+	// semi-lagrangian backtrace of the cells [x_begin, x_end) of row y, bilinear sample of
+	// src (plane base pointer, not a row pointer) at (x + .5, y + .5) - (u, v) * dt.
+	// dst / u / v still point at cell 0 of the row
+	void (*advectRow)(float* dst, const float* src, const float* u, const float* v,
+		int y, int x_begin, int x_end, int width, int height, float dt);
+};
+
+enum class KernelIsa
+{
+	Scalar,
+	Avx2,
+	Avx512
+};
+
+// best instruction set this cpu (and os) supports
+KernelIsa detectKernelIsa();
+
+// nullptr if the isa wasn't compiled in or the cpu can't run it
+const FluidKernels* getFluidKernels(KernelIsa isa);
+
+const char* kernelIsaName(KernelIsa isa);
+
+// per isa tables, defined in FluidKernels*.cpp
+const FluidKernels* getScalarFluidKernels();
+const FluidKernels* getAvx2FluidKernels();
+const FluidKernels* getAvx512FluidKernels();
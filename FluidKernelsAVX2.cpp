@@ -0,0 +1,197 @@
+#include "FluidKernels.h"
+
+// built with /arch:AVX2 in the vcxproj, gcc/clang get it per function.
+// only reached through getFluidKernels() after the cpuid check
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#if defined(__GNUC__)
+#define FLUID_AVX2 __attribute__((target("avx2")))
+#if !defined(__clang__)
+// keep gcc from fusing mul + add, the scalar reference doesn't
+#pragma GCC optimize("fp-contract=off")
+#endif
+#else
+#define FLUID_AVX2
+#endif
+
+// same op order as the scalar kernels, no fma, so results match bit for bit
+
+FLUID_AVX2 static inline __m256 relaxBlockAvx2(const float* v, const float* v0, int stride, __m256 va, __m256 vc)
+{
+	__m256 neighbor_sum = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+		_mm256_loadu_ps(v - 1),
+		_mm256_loadu_ps(v + 1)),
+		_mm256_loadu_ps(v - stride)),
+		_mm256_loadu_ps(v + stride));
+
+	return _mm256_div_ps(_mm256_add_ps(_mm256_loadu_ps(v0), _mm256_mul_ps(va, neighbor_sum)), vc);
+}
+
+FLUID_AVX2 static void relaxRowAvx2(float* v, const float* v0, int stride, int width, int first_x, float a, float c)
+{
+	const int block = 4;
+
+	__m256 va = _mm256_set1_ps(a);
+	__m256 vc = _mm256_set1_ps(c);
+
+	// blocks start on even x, so the colour is a fixed lane pattern. the stores are masked
+	// by it, cells of the other colour are never written (other threads read them)
+	__m256i color = first_x == 0
+		? _mm256_setr_epi32(-1, 0, -1, 0, -1, 0, -1, 0)
+		: _mm256_setr_epi32(0, -1, 0, -1, 0, -1, 0, -1);
+
+	// the left/right loads overlap the previous store. all loads of a block go
+	// before its stores so that costs one store forwarding stall per block, not per vector
+	int x = 0;
+	for (; x + 8 * block <= width; x += 8 * block)
+	{
+		__m256 result[block];
+		for (int i = 0; i < block; ++i)
+			result[i] = relaxBlockAvx2(v + x + 8 * i, v0 + x + 8 * i, stride, va, vc);
+		for (int i = 0; i < block; ++i)
+			_mm256_maskstore_ps(v + x + 8 * i, color, result[i]);
+	}
+
+	for (; x + 8 <= width; x += 8)
+	{
+		_mm256_maskstore_ps(v + x, color, relaxBlockAvx2(v + x, v0 + x, stride, va, vc));
+	}
+
+	// tail
+	for (x += first_x; x < width; x += 2)
+	{
+		float neighbor_sum = v[x - 1] + v[x + 1] + v[x - stride] + v[x + stride];
+		v[x] = (v0[x] + a * neighbor_sum) / c;
+	}
+}
+
+FLUID_AVX2 static void divergenceRowAvx2(float* div, const float* u, const float* v, int stride, int width, float scale)
+{
+	__m256 vscale = _mm256_set1_ps(scale);
+
+	int x = 0;
+	for (; x + 8 <= width; x += 8)
+	{
+		__m256 sum = _mm256_sub_ps(_mm256_add_ps(_mm256_sub_ps(
+			_mm256_loadu_ps(u + x + 1),
+			_mm256_loadu_ps(u + x - 1)),
+			_mm256_loadu_ps(v + x + stride)),
+			_mm256_loadu_ps(v + x - stride));
+		_mm256_storeu_ps(div + x, _mm256_mul_ps(vscale, sum));
+	}
+
+	for (; x < width; ++x)
+	{
+		div[x] = scale * (u[x + 1] - u[x - 1] + v[x + stride] - v[x - stride]);
+	}
+}
+
+FLUID_AVX2 static void gradientRowAvx2(float* u, float* v, const float* p, int stride, int width, float scale)
+{
+	__m256 vscale = _mm256_set1_ps(scale);
+
+	int x = 0;
+	for (; x + 8 <= width; x += 8)
+	{
+		__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(p + x + 1), _mm256_loadu_ps(p + x - 1));
+		__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(p + x + stride), _mm256_loadu_ps(p + x - stride));
+		_mm256_storeu_ps(u + x, _mm256_sub_ps(_mm256_loadu_ps(u + x), _mm256_mul_ps(vscale, dx)));
+		_mm256_storeu_ps(v + x, _mm256_sub_ps(_mm256_loadu_ps(v + x), _mm256_mul_ps(vscale, dy)));
+	}
+
+	for (; x < width; ++x)
+	{
+		u[x] -= scale * (p[x + 1] - p[x - 1]);
+		v[x] -= scale * (p[x + stride] - p[x - stride]);
+	}
+}
+
+FLUID_AVX2 static void advectRowAvx2(float* dst, const float* src, const float* u, const float* v,
+	int y, int x_begin, int x_end, int width, int height, float dt)
+{
+	int stride = width + 2;
+	float max_x = (float)(width - 1);
+	float max_y = (float)(height - 1);
+
+	__m256 vdt = _mm256_set1_ps(dt);
+	__m256 zero = _mm256_setzero_ps();
+	__m256 vmax_x = _mm256_set1_ps(max_x);
+	__m256 vmax_y = _mm256_set1_ps(max_y);
+	__m256 half = _mm256_set1_ps(.5f);
+	__m256 current_y = _mm256_set1_ps((float)y + .5f);
+	__m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i one = _mm256_set1_epi32(1);
+	__m256i vstride = _mm256_set1_epi32(stride);
+
+	int x = x_begin;
+	for (; x + 8 <= x_end; x += 8)
+	{
+		__m256 current_x = _mm256_add_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(x), lane)), half);
+
+		__m256 prev_x = _mm256_sub_ps(current_x, _mm256_mul_ps(_mm256_loadu_ps(u + x), vdt));
+		__m256 prev_y = _mm256_sub_ps(current_y, _mm256_mul_ps(_mm256_loadu_ps(v + x), vdt));
+		prev_x = _mm256_min_ps(_mm256_max_ps(prev_x, zero), vmax_x);
+		prev_y = _mm256_min_ps(_mm256_max_ps(prev_y, zero), vmax_y);
+
+		// positive after the clamp, truncation == floor
+		__m256i x0 = _mm256_cvttps_epi32(prev_x);
+		__m256i y0 = _mm256_cvttps_epi32(prev_y);
+		__m256 sx = _mm256_sub_ps(prev_x, _mm256_cvtepi32_ps(x0));
+		__m256 sy = _mm256_sub_ps(prev_y, _mm256_cvtepi32_ps(y0));
+
+		__m256i index = _mm256_add_epi32(_mm256_add_epi32(x0, one),
+			_mm256_mullo_epi32(_mm256_add_epi32(y0, one), vstride));
+
+		__m256 v00 = _mm256_i32gather_ps(src, index, 4);
+		__m256 v10 = _mm256_i32gather_ps(src + 1, index, 4);
+		__m256 v01 = _mm256_i32gather_ps(src + stride, index, 4);
+		__m256 v11 = _mm256_i32gather_ps(src + stride + 1, index, 4);
+
+		__m256 top = _mm256_add_ps(v00, _mm256_mul_ps(sx, _mm256_sub_ps(v10, v00)));
+		__m256 bottom = _mm256_add_ps(v01, _mm256_mul_ps(sx, _mm256_sub_ps(v11, v01)));
+		_mm256_storeu_ps(dst + x, _mm256_add_ps(top, _mm256_mul_ps(sy, _mm256_sub_ps(bottom, top))));
+	}
+
+	// tail, same math as advectRowScalar
+	for (; x < x_end; ++x)
+	{
+		float prev_x = ((float)x + .5f) - u[x] * dt;
+		float prev_y = ((float)y + .5f) - v[x] * dt;
+		prev_x = prev_x < 0.0f ? 0.0f : prev_x;
+		prev_x = max_x < prev_x ? max_x : prev_x;
+		prev_y = prev_y < 0.0f ? 0.0f : prev_y;
+		prev_y = max_y < prev_y ? max_y : prev_y;
+
+		int x0 = (int)prev_x;
+		int y0 = (int)prev_y;
+		float sx = prev_x - (float)x0;
+		float sy = prev_y - (float)y0;
+
+		int index = (x0 + 1) + (y0 + 1) * stride;
+		float top = src[index] + sx * (src[index + 1] - src[index]);
+		float bottom = src[index + stride] + sx * (src[index + stride + 1] - src[index + stride]);
+		dst[x] = top + sy * (bottom - top);
+	}
+}
+
+const FluidKernels* getAvx2FluidKernels()
+{
+	static const FluidKernels kernels = {
+		"avx2",
+		relaxRowAvx2,
+		divergenceRowAvx2,
+		gradientRowAvx2,
+		advectRowAvx2
+	};
+	return &kernels;
+}
+
+#else
+
+const FluidKernels* getAvx2FluidKernels()
+{
+	return nullptr;
+}
+
+#endif
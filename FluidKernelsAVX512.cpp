@@ -0,0 +1,166 @@
+#include "FluidKernels.h"
+
+// built with /arch:AVX512 in the vcxproj, gcc/clang get it per function.
+// only reached through getFluidKernels() after the cpuid check
+#if defined(_M_X64) || defined(__x86_64__)
+#include <immintrin.h>
+
+#if defined(__GNUC__)
+#define FLUID_AVX512 __attribute__((target("avx512f")))
+#if !defined(__clang__)
+// avx512f implies fma, keep gcc from fusing mul + add like the scalar reference
+#pragma GCC optimize("fp-contract=off")
+#endif
+#else
+#define FLUID_AVX512
+#endif
+
+// same op order as the scalar kernels, no fma, so results match bit for bit.
+// tails use masked loads/stores instead of a scalar loop
+
+FLUID_AVX512 static inline __mmask16 tailMask(int remaining)
+{
+	return remaining >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << remaining) - 1);
+}
+
+FLUID_AVX512 static inline __m512 relaxBlockAvx512(const float* v, const float* v0, int stride, __m512 va, __m512 vc,
+	__mmask16 mask)
+{
+	__m512 neighbor_sum = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(
+		_mm512_maskz_loadu_ps(mask, v - 1),
+		_mm512_maskz_loadu_ps(mask, v + 1)),
+		_mm512_maskz_loadu_ps(mask, v - stride)),
+		_mm512_maskz_loadu_ps(mask, v + stride));
+
+	return _mm512_div_ps(_mm512_add_ps(_mm512_maskz_loadu_ps(mask, v0), _mm512_mul_ps(va, neighbor_sum)), vc);
+}
+
+FLUID_AVX512 static void relaxRowAvx512(float* v, const float* v0, int stride, int width, int first_x, float a, float c)
+{
+	const int block = 4;
+
+	__m512 va = _mm512_set1_ps(a);
+	__m512 vc = _mm512_set1_ps(c);
+
+	// blocks start on even x, so the colour is a fixed lane pattern. the stores are masked
+	// by it, cells of the other colour are never written (other threads read them)
+	__mmask16 color = first_x == 0 ? (__mmask16)0x5555 : (__mmask16)0xaaaa;
+
+	// the left/right loads overlap the previous store. all loads of a block go
+	// before its stores so that costs one store forwarding stall per block, not per vector
+	int x = 0;
+	for (; x + 16 * block <= width; x += 16 * block)
+	{
+		__m512 result[block];
+		for (int i = 0; i < block; ++i)
+			result[i] = relaxBlockAvx512(v + x + 16 * i, v0 + x + 16 * i, stride, va, vc, 0xffff);
+		for (int i = 0; i < block; ++i)
+			_mm512_mask_storeu_ps(v + x + 16 * i, color, result[i]);
+	}
+
+	for (; x < width; x += 16)
+	{
+		__mmask16 mask = tailMask(width - x);
+		_mm512_mask_storeu_ps(v + x, mask & color, relaxBlockAvx512(v + x, v0 + x, stride, va, vc, mask));
+	}
+}
+
+FLUID_AVX512 static void divergenceRowAvx512(float* div, const float* u, const float* v, int stride, int width, float scale)
+{
+	__m512 vscale = _mm512_set1_ps(scale);
+
+	for (int x = 0; x < width; x += 16)
+	{
+		__mmask16 mask = tailMask(width - x);
+
+		__m512 sum = _mm512_sub_ps(_mm512_add_ps(_mm512_sub_ps(
+			_mm512_maskz_loadu_ps(mask, u + x + 1),
+			_mm512_maskz_loadu_ps(mask, u + x - 1)),
+			_mm512_maskz_loadu_ps(mask, v + x + stride)),
+			_mm512_maskz_loadu_ps(mask, v + x - stride));
+		_mm512_mask_storeu_ps(div + x, mask, _mm512_mul_ps(vscale, sum));
+	}
+}
+
+FLUID_AVX512 static void gradientRowAvx512(float* u, float* v, const float* p, int stride, int width, float scale)
+{
+	__m512 vscale = _mm512_set1_ps(scale);
+
+	for (int x = 0; x < width; x += 16)
+	{
+		__mmask16 mask = tailMask(width - x);
+
+		__m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, p + x + 1), _mm512_maskz_loadu_ps(mask, p + x - 1));
+		__m512 dy = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, p + x + stride), _mm512_maskz_loadu_ps(mask, p + x - stride));
+		_mm512_mask_storeu_ps(u + x, mask, _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, u + x), _mm512_mul_ps(vscale, dx)));
+		_mm512_mask_storeu_ps(v + x, mask, _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, v + x), _mm512_mul_ps(vscale, dy)));
+	}
+}
+
+FLUID_AVX512 static void advectRowAvx512(float* dst, const float* src, const float* u, const float* v,
+	int y, int x_begin, int x_end, int width, int height, float dt)
+{
+	int stride = width + 2;
+
+	__m512 vdt = _mm512_set1_ps(dt);
+	__m512 zero = _mm512_setzero_ps();
+	__m512 vmax_x = _mm512_set1_ps((float)(width - 1));
+	__m512 vmax_y = _mm512_set1_ps((float)(height - 1));
+	__m512 half = _mm512_set1_ps(.5f);
+	__m512 current_y = _mm512_set1_ps((float)y + .5f);
+	__m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m512i one = _mm512_set1_epi32(1);
+	__m512i vstride = _mm512_set1_epi32(stride);
+
+	for (int x = x_begin; x < x_end; x += 16)
+	{
+		__mmask16 mask = tailMask(x_end - x);
+
+		__m512 current_x = _mm512_add_ps(_mm512_cvtepi32_ps(_mm512_add_epi32(_mm512_set1_epi32(x), lane)), half);
+
+		__m512 prev_x = _mm512_sub_ps(current_x, _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, u + x), vdt));
+		__m512 prev_y = _mm512_sub_ps(current_y, _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, v + x), vdt));
+		prev_x = _mm512_min_ps(_mm512_max_ps(prev_x, zero), vmax_x);
+		prev_y = _mm512_min_ps(_mm512_max_ps(prev_y, zero), vmax_y);
+
+		// positive after the clamp, truncation == floor
+		__m512i x0 = _mm512_cvttps_epi32(prev_x);
+		__m512i y0 = _mm512_cvttps_epi32(prev_y);
+		__m512 sx = _mm512_sub_ps(prev_x, _mm512_cvtepi32_ps(x0));
+		__m512 sy = _mm512_sub_ps(prev_y, _mm512_cvtepi32_ps(y0));
+
+		__m512i index = _mm512_add_epi32(_mm512_add_epi32(x0, one),
+			_mm512_mullo_epi32(_mm512_add_epi32(y0, one), vstride));
+
+		// masked lanes gather nothing
+		__m512 v00 = _mm512_mask_i32gather_ps(zero, mask, index, src, 4);
+		__m512 v10 = _mm512_mask_i32gather_ps(zero, mask, index, src + 1, 4);
+		__m512 v01 = _mm512_mask_i32gather_ps(zero, mask, index, src + stride, 4);
+		__m512 v11 = _mm512_mask_i32gather_ps(zero, mask, index, src + stride + 1, 4);
+
+		__m512 top = _mm512_add_ps(v00, _mm512_mul_ps(sx, _mm512_sub_ps(v10, v00)));
+		__m512 bottom = _mm512_add_ps(v01, _mm512_mul_ps(sx, _mm512_sub_ps(v11, v01)));
+		_mm512_mask_storeu_ps(dst + x, mask, _mm512_add_ps(top, _mm512_mul_ps(sy, _mm512_sub_ps(bottom, top))));
+	}
+}
+
+const FluidKernels* getAvx512FluidKernels()
+{
+	static const FluidKernels kernels = {
+		"avx512",
+		relaxRowAvx512,
+		divergenceRowAvx512,
+		gradientRowAvx512,
+		advectRowAvx512
+	};
+	return &kernels;
+}
+
+#else
+
+const FluidKernels* getAvx512FluidKernels()
+{
+	return nullptr;
+}
+
+#endif
@@ -1,8 +1,17 @@
 #include "GpuGrid3D.h"
 #include <iostream>
 #include <vector>
+#include <cmath>
+#include <string>
+#include <algorithm>
+#include <cstring>
 
 GLuint GpuGrid3D::create3DTexture(int internal_format, int format)
+{
+    return create3DTexture(internal_format, format, m_width, m_height, m_depth);
+}
+
+GLuint GpuGrid3D::create3DTexture(int internal_format, int format, int width, int height, int depth)
 {
     GLuint textureID;
     glGenTextures(1, &textureID);
@@ -15,28 +24,356 @@ GLuint GpuGrid3D::create3DTexture(int internal_format, int format)
     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 
     // alloc, fill nullptr
-    glTexImage3D(GL_TEXTURE_3D, 0, internal_format, m_width, m_height, m_depth,
+    glTexImage3D(GL_TEXTURE_3D, 0, internal_format, width, height, depth,
         0, format, GL_FLOAT, nullptr);
 
     glBindTexture(GL_TEXTURE_3D, 0);
     return textureID;
 }
 
-GpuGrid3D::GpuGrid3D(int width, int height, int depth)
-    : m_width(width), m_height(height), m_depth(depth)
+static std::string imageFormatDefine(GLenum internal_format)
+{
+    // layout qualifier matching the texture, see IMAGE_FORMAT in the .comp files.
+    // SCALAR_FIELD picks the density side of the step uniforms in diffuse
+    const char* qualifier = "rgba32f";
+    switch (internal_format)
+    {
+    case GL_R32F: qualifier = "r32f"; break;
+    case GL_RGBA16F: qualifier = "rgba16f"; break;
+    }
+
+    std::string defines = std::string("#define IMAGE_FORMAT ") + qualifier + "\n";
+    if (internal_format == GL_R32F)
+        defines += "#define SCALAR_FIELD\n";
+    return defines;
+}
+
+static GLenum checkVelocityFormat(GLenum velocity_format)
 {
-    // density
-    m_densityTexA = create3DTexture(GL_RGBA32F, GL_RGBA);
-    m_densityTexB = create3DTexture(GL_RGBA32F, GL_RGBA);
+    if (velocity_format != GL_RGBA16F && velocity_format != GL_RGBA32F)
+    {
+        std::cerr << "GpuGrid3D: velocity format has to be GL_RGBA16F or GL_RGBA32F, using GL_RGBA32F" << std::endl;
+        return GL_RGBA32F;
+    }
+    return velocity_format;
+}
+
+static int tileIterations(int value_size)
+{
+    // largest k (up to 4) whose (8 + 2k)^3 tile fits in shared memory.
+    // the spec guarantees 32k: float gets 4, vec4 gets 2
+    GLint shared_size = 32768;
+    glGetIntegerv(GL_MAX_COMPUTE_SHARED_MEMORY_SIZE, &shared_size);
+
+    int iterations = 1;
+    while (iterations < 4)
+    {
+        int tile = 8 + 2 * (iterations + 1);
+        if (tile * tile * tile * value_size > shared_size)
+            break;
+        ++iterations;
+    }
+    return iterations;
+}
+
+static std::string tileDefines(int tile_iterations, bool vec4_values)
+{
+    std::string defines = "#define TILE_ITERATIONS " + std::to_string(tile_iterations) + "\n";
+    if (vec4_values)
+        defines += "#define TILE_VEC4\n";
+    return defines;
+}
+
+// per step constants, step() fills them into uniform buffer binding 0 once per step. the block
+// is put in front of every stage shader that reads it, StepUniforms is its std140 mirror
+static std::string stepUniformsSource()
+{
+    return
+        "layout (std140, binding = 0) uniform StepUniforms\n"
+        "{\n"
+        "    vec4 u_gridSize;     // xyz\n"
+        "    vec4 u_diffusion;    // velocity alpha, rBeta, density alpha, rBeta\n"
+        "    float u_dt;\n"
+        "};\n";
+}
+
+struct StepUniforms
+{
+    glm::vec4 gridSize;    // xyz
+    glm::vec4 diffusion;   // velocity alpha, rBeta, density alpha, rBeta
+    float dt;
+    float padding[3];
+};
+static_assert(sizeof(StepUniforms) == 48, "StepUniforms has to match the std140 block");
+
+// brick lists: indirect dispatch size, count, then the bricks packed x | y << 10 | z << 20.
+// stage shaders get the list they run on (dispatchBricks) as a readonly BrickList with
+// brickOrigin(), one group per brick and the spare groups of the last row quit.
+// brick_activity.comp writes the lists, it only takes the members and packBrick
+static std::string brickListSource(bool stage)
+{
+    std::string source =
+        "#define BRICK_LIST_MEMBERS uint dispatch_size[3]; uint brick_count; uint bricks[];\n"
+        "uint packBrick(ivec3 brick)\n"
+        "{\n"
+        "    return uint(brick.x) | (uint(brick.y) << 10) | (uint(brick.z) << 20);\n"
+        "}\n";
+    if (!stage)
+        return source;
+
+    return source +
+        "layout (std430, binding = 3) readonly buffer BrickList\n"
+        "{\n"
+        "    BRICK_LIST_MEMBERS\n"
+        "};\n"
+        "bool brickOrigin(out ivec3 origin)\n"
+        "{\n"
+        "    uint index = gl_WorkGroupID.x + gl_WorkGroupID.y * gl_NumWorkGroups.x;\n"
+        "    if (index >= brick_count)\n"
+        "        return false;\n"
+        "    uint brick = bricks[index];\n"
+        "    origin = ivec3(brick & 1023u, (brick >> 10) & 1023u, brick >> 20) * "
+        + std::to_string(GpuGrid3D::k_brick_size) + ";\n"
+        "    return true;\n"
+        "}\n";
+}
+
+static GLuint packBrick(GLuint x, GLuint y, GLuint z)
+{
+    return x | (y << 10) | (z << 20);
+}
+
+GpuGrid3D::GpuGrid3D(int width, int height, int depth, GLenum velocity_format)
+    : m_width(width), m_height(height), m_depth(depth),
+    m_scalarFormat(GL_R32F), m_velocityFormat(checkVelocityFormat(velocity_format)),
+    m_velocityTexC(0),
+    m_scalarTileIterations(tileIterations(sizeof(float))),
+    m_velocityTileIterations(tileIterations(sizeof(glm::vec4))),
+    m_splatShader("splat.comp", imageFormatDefine(m_velocityFormat) + stepUniformsSource()),
+    m_diffuseScalarShader("diffuse.comp",
+        imageFormatDefine(m_scalarFormat) + stepUniformsSource() + brickListSource(true)),
+    m_diffuseVelocityShader("diffuse.comp",
+        imageFormatDefine(m_velocityFormat) + stepUniformsSource() + brickListSource(true)),
+    m_diffuseFusedShader("diffuse.comp",
+        imageFormatDefine(m_velocityFormat) + "#define FUSED\n" + stepUniformsSource() + brickListSource(true)),
+    m_advectScalarShader("advect.comp",
+        imageFormatDefine(m_scalarFormat) + stepUniformsSource() + brickListSource(true)),
+    m_advectVelocityShader("advect.comp",
+        imageFormatDefine(m_velocityFormat) + stepUniformsSource() + brickListSource(true)),
+    m_clearScalarShader("clear.comp", imageFormatDefine(m_scalarFormat) + brickListSource(true)),
+    m_clearVelocityShader("clear.comp", imageFormatDefine(m_velocityFormat) + brickListSource(true)),
+    m_divergenceShader("divergence.comp",
+        imageFormatDefine(m_scalarFormat) + stepUniformsSource() + brickListSource(true)),
+    m_pressureShader("pressure.comp", imageFormatDefine(m_scalarFormat)),
+    m_gradientShader("gradient.comp",
+        imageFormatDefine(m_velocityFormat) + stepUniformsSource() + brickListSource(true)),
+    m_residualShader("residual.comp", stepUniformsSource()),
+    m_jacobiTiledScalarShader("jacobi_tiled.comp", imageFormatDefine(m_scalarFormat)
+        + tileDefines(m_scalarTileIterations, false) + stepUniformsSource() + brickListSource(true)),
+    m_jacobiTiledVelocityShader("jacobi_tiled.comp", imageFormatDefine(m_velocityFormat)
+        + tileDefines(m_velocityTileIterations, true) + stepUniformsSource() + brickListSource(true)),
+    m_jacobiTiledFusedShader("jacobi_tiled.comp", imageFormatDefine(m_velocityFormat)
+        + tileDefines(m_velocityTileIterations, true) + "#define TILE_FUSED\n" + stepUniformsSource()
+        + brickListSource(true)),
+    m_mgSmoothShader("multigrid.comp", std::string("#define MG_SMOOTH\n")),
+    m_mgRestrictShader("multigrid.comp", std::string("#define MG_RESTRICT\n")),
+    m_mgProlongShader("multigrid.comp", std::string("#define MG_PROLONG\n")),
+    m_maxVelocityShader("max_velocity.comp", stepUniformsSource()),
+    m_occupancyShader("occupancy.comp"),
+    m_lightShader("light.comp"),
+    m_brickMarkShader("brick_activity.comp", "#define BRICK_MARK\n" + brickListSource(false)),
+    m_brickCompactShader("brick_activity.comp", "#define BRICK_COMPACT\n" + brickListSource(false)),
+    m_brickArgsShader("brick_activity.comp", "#define BRICK_ARGS\n" + brickListSource(false)),
+    m_tiled_jacobi(true), m_diffuse_skip_alpha(0.0f),
+    m_pressure_solver(PressureSolver::Jacobi),
+    m_multigrid_cycles(2), m_multigrid_smoothing(2), m_multigrid_coarse_smoothing(32),
+    m_pressure_warm_start(true), m_pressure_tolerance(0.0f), m_pressure_check_interval(4),
+    m_last_pressure_iterations(0), m_last_pressure_residual(-1.0f),
+    m_max_velocity_reduction(false), m_max_velocity(-1.0f), m_max_velocity_mapped(nullptr),
+    m_max_velocity_fences(), m_max_velocity_slot(0),
+    m_emitter_capacity(1), m_emitters_min(0.0f), m_emitters_max(0.0f),
+    m_occupancy_dirty(true),
+    m_light_volume(false), m_light_dirty(true),
+    m_light_direction(0.0f, 1.0f, 0.0f), m_light_absorption(.5f),
+    m_brick_count(0), m_sparse_bricks(false), m_brick_threshold(1e-3f)
+{
+    // density (scalar, .r only)
+    m_densityTexA = create3DTexture(m_scalarFormat, GL_RED);
+    m_densityTexB = create3DTexture(m_scalarFormat, GL_RED);
 
     // velo
-    m_velocityTexA = create3DTexture(GL_RGBA32F, GL_RGBA);
-    m_velocityTexB = create3DTexture(GL_RGBA32F, GL_RGBA);
+    m_velocityTexA = create3DTexture(m_velocityFormat, GL_RGBA);
+    m_velocityTexB = create3DTexture(m_velocityFormat, GL_RGBA);
+
+    // div - pressure (scalar)
+    m_divergenceTex = create3DTexture(m_scalarFormat, GL_RED);
+    m_pressureTexA = create3DTexture(m_scalarFormat, GL_RED);
+    m_pressureTexB = create3DTexture(m_scalarFormat, GL_RED);
+
+    // bricks, one texel per work group. nearest, the raymarcher fetches whole bricks
+    GLuint bricksX, bricksY, bricksZ;
+    getWorkGroups(bricksX, bricksY, bricksZ);
+    m_occupancySize = glm::ivec3(bricksX, bricksY, bricksZ);
+    m_occupancyTex = create3DTexture(GL_R32F, GL_RED, bricksX, bricksY, bricksZ);
+    m_lightTex = 0; // made by setLightVolume
+    m_lightSize = glm::ivec3(0, 0, 0);
+    glBindTexture(GL_TEXTURE_3D, m_occupancyTex);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_3D, 0);
 
-    // div - pressure
-    m_divergenceTex = create3DTexture(GL_RGBA32F, GL_RGBA);
-    m_pressureTexA = create3DTexture(GL_RGBA32F, GL_RGBA);
-    m_pressureTexB = create3DTexture(GL_RGBA32F, GL_RGBA);
+    // residual reduction output
+    GLuint groupsX, groupsY, groupsZ;
+    getWorkGroups(groupsX, groupsY, groupsZ);
+    m_residual_partials.resize(groupsX * groupsY * groupsZ);
+
+    glGenBuffers(1, &m_residualBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_residualBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, m_residual_partials.size() * sizeof(glm::vec2), nullptr, GL_DYNAMIC_READ);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    // brick lists. the full one never changes, the sparse ones start out empty
+    {
+        const GLuint max_row = 65535; // see brick_activity.comp
+        m_brick_count = (int)(groupsX * groupsY * groupsZ);
+
+        std::vector<GLuint> all_bricks(4 + m_brick_count);
+        all_bricks[0] = std::min((GLuint)m_brick_count, max_row);
+        all_bricks[1] = (m_brick_count + max_row - 1) / max_row;
+        all_bricks[2] = 1;
+        all_bricks[3] = m_brick_count;
+
+        GLuint* packed = all_bricks.data() + 4;
+        for (GLuint z = 0; z < groupsZ; ++z)
+            for (GLuint y = 0; y < groupsY; ++y)
+                for (GLuint x = 0; x < groupsX; ++x)
+                    *packed++ = packBrick(x, y, z);
+
+        GLsizeiptr list_size = all_bricks.size() * sizeof(GLuint);
+        std::vector<GLuint> zeros(all_bricks.size(), 0);
+
+        glGenBuffers(1, &m_allBricksBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_allBricksBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, list_size, all_bricks.data(), GL_STATIC_DRAW);
+
+        GLuint* lists[] = { &m_activeBricksBuffer, &m_clearedBricksBuffer };
+        for (GLuint* list : lists)
+        {
+            glGenBuffers(1, list);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, *list);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, list_size, zeros.data(), GL_DYNAMIC_COPY);
+        }
+
+        GLuint* flags[] = { &m_brickContentBuffer, &m_brickActiveBuffer };
+        for (GLuint* flag : flags)
+        {
+            glGenBuffers(1, flag);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, *flag);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, m_brick_count * sizeof(GLuint), zeros.data(), GL_DYNAMIC_COPY);
+        }
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    // per step uniforms (stepUniformsSource)
+    glGenBuffers(1, &m_stepUniformBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, m_stepUniformBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(StepUniforms), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    // emitters, room for the brush until setEmitters needs more
+    static_assert(sizeof(EmitterData) == 48, "EmitterData has to match the std430 struct");
+    glGenBuffers(1, &m_emitterBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_emitterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, m_emitter_capacity * sizeof(EmitterData), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    // max |velocity| slots. mapped once for good where the driver can (4.4 / ARB_buffer_storage),
+    // else read with glGetBufferSubData, also only once the fence says the slot is done
+    GLuint zeros[k_max_velocity_slots] = {};
+    glGenBuffers(1, &m_maxVelocityBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_maxVelocityBuffer);
+    if (GLAD_GL_ARB_buffer_storage)
+    {
+        GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_SHADER_STORAGE_BUFFER, sizeof(zeros), zeros, flags);
+        m_max_velocity_mapped = (GLuint*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zeros), flags);
+    }
+    else
+    {
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(zeros), zeros, GL_DYNAMIC_READ);
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    // sampler units never change, set them once
+    struct SamplerUnit
+    {
+        Shader* shader;
+        const char* name;
+        int unit;
+    };
+
+    SamplerUnit samplerUnits[] = {
+        { &m_diffuseScalarShader, "u_x", 0 }, { &m_diffuseScalarShader, "u_b", 1 },
+        { &m_diffuseVelocityShader, "u_x", 0 }, { &m_diffuseVelocityShader, "u_b", 1 },
+        { &m_jacobiTiledScalarShader, "u_x", 0 }, { &m_jacobiTiledScalarShader, "u_b", 1 },
+        { &m_jacobiTiledVelocityShader, "u_x", 0 }, { &m_jacobiTiledVelocityShader, "u_b", 1 },
+        { &m_diffuseFusedShader, "u_x", 0 }, { &m_diffuseFusedShader, "u_b", 1 },
+        { &m_diffuseFusedShader, "u_x_density", 2 }, { &m_diffuseFusedShader, "u_b_density", 3 },
+        { &m_jacobiTiledFusedShader, "u_x", 0 }, { &m_jacobiTiledFusedShader, "u_b", 1 },
+        { &m_jacobiTiledFusedShader, "u_x_density", 2 }, { &m_jacobiTiledFusedShader, "u_b_density", 3 },
+        { &m_divergenceShader, "u_velocityField", 0 },
+        { &m_pressureShader, "u_pressure", 0 }, { &m_pressureShader, "u_divergence", 1 },
+        { &m_residualShader, "u_pressure", 0 }, { &m_residualShader, "u_divergence", 1 },
+        { &m_gradientShader, "u_velocityField", 0 }, { &m_gradientShader, "u_pressureField", 1 },
+        { &m_advectScalarShader, "u_velocityField_sampler", 0 }, { &m_advectScalarShader, "u_quantityToMove_sampler", 1 },
+        { &m_advectVelocityShader, "u_velocityField_sampler", 0 }, { &m_advectVelocityShader, "u_quantityToMove_sampler", 1 },
+        { &m_maxVelocityShader, "u_velocity", 0 },
+        { &m_occupancyShader, "u_density", 0 },
+        { &m_lightShader, "u_density", 0 },
+        { &m_brickMarkShader, "u_density", 0 }, { &m_brickMarkShader, "u_velocity", 1 }
+    };
+
+    for (const SamplerUnit& sampler : samplerUnits)
+        glProgramUniform1i(sampler.shader->ID, sampler.shader->getUniformLocation(sampler.name), sampler.unit);
+
+    // multigrid levels, halved like mips until one side is 4 or less
+    glm::ivec3 finest_size(m_width, m_height, m_depth);
+    glm::ivec3 size = finest_size;
+    while (true)
+    {
+        MultigridLevel level;
+        level.width = size.x;
+        level.height = size.y;
+        level.depth = size.z;
+
+        // level l cell i sits at 2^l * i + (2^l - 1) / 2 in finest cells, the finest level
+        // is zero at -1 and at size. a ghost of g * p(edge) puts the zero crossing there
+        float scale = (float)(1 << m_multigrid_levels.size());
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float dist_low = ((scale - 1.0f) * 0.5f + 1.0f) / scale;
+            float last_cell = scale * (size[axis] - 1) + (scale - 1.0f) * 0.5f;
+            float dist_high = ((float)finest_size[axis] - last_cell) / scale;
+            level.ghostLow[axis] = -(1.0f - dist_low) / dist_low;
+            level.ghostHigh[axis] = -(1.0f - dist_high) / dist_high;
+        }
+
+        if (m_multigrid_levels.empty())
+        {
+            level.pressureTex = 0;
+            level.rhsTex = 0;
+        }
+        else
+        {
+            level.pressureTex = create3DTexture(GL_R32F, GL_RED, size.x, size.y, size.z);
+            level.rhsTex = create3DTexture(GL_R32F, GL_RED, size.x, size.y, size.z);
+        }
+        m_multigrid_levels.push_back(level);
+
+        if (size.x <= 4 || size.y <= 4 || size.z <= 4)
+            break;
+        size /= 2;
+    }
 }
 
 GpuGrid3D::~GpuGrid3D()
@@ -44,38 +381,361 @@ GpuGrid3D::~GpuGrid3D()
     GLuint textures[] = {
         m_densityTexA, m_densityTexB,
         m_velocityTexA, m_velocityTexB,
-        m_divergenceTex, m_pressureTexA, m_pressureTexB
+        m_divergenceTex, m_pressureTexA, m_pressureTexB,
+        m_velocityTexC, m_occupancyTex, m_lightTex
+    };
+    glDeleteTextures(10, textures);
+    glDeleteBuffers(1, &m_residualBuffer);
+    glDeleteBuffers(1, &m_stepUniformBuffer);
+    glDeleteBuffers(1, &m_emitterBuffer);
+
+    GLuint brick_buffers[] = {
+        m_allBricksBuffer, m_activeBricksBuffer, m_clearedBricksBuffer,
+        m_brickContentBuffer, m_brickActiveBuffer
     };
-    glDeleteTextures(7, textures);
+    glDeleteBuffers(5, brick_buffers);
+
+    dropMaxVelocityReadbacks();
+    if (m_max_velocity_mapped)
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_maxVelocityBuffer);
+        glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+    glDeleteBuffers(1, &m_maxVelocityBuffer);
+
+    for (size_t i = 1; i < m_multigrid_levels.size(); ++i)
+    {
+        glDeleteTextures(1, &m_multigrid_levels[i].pressureTex);
+        glDeleteTextures(1, &m_multigrid_levels[i].rhsTex);
+    }
+
+    Shader* shaders[] = {
+        &m_splatShader,
+        &m_diffuseScalarShader, &m_diffuseVelocityShader, &m_diffuseFusedShader,
+        &m_advectScalarShader, &m_advectVelocityShader,
+        &m_clearScalarShader, &m_clearVelocityShader,
+        &m_divergenceShader, &m_pressureShader, &m_gradientShader, &m_residualShader,
+        &m_jacobiTiledScalarShader, &m_jacobiTiledVelocityShader, &m_jacobiTiledFusedShader,
+        &m_mgSmoothShader, &m_mgRestrictShader, &m_mgProlongShader,
+        &m_maxVelocityShader, &m_occupancyShader, &m_lightShader,
+        &m_brickMarkShader, &m_brickCompactShader, &m_brickArgsShader
+    };
+    for (Shader* shader : shaders)
+        glDeleteProgram(shader->ID);
+}
+
+GpuGrid3D::EmitterData GpuGrid3D::packEmitter(const Emitter& emitter)
+{
+    EmitterData data;
+    data.position = glm::vec4(emitter.position, (float)emitter.shape);
+    data.size = glm::vec4(emitter.size, emitter.rate);
+    data.force = glm::vec4(emitter.force, 0.0f);
+    return data;
 }
 
-void GpuGrid3D::clear(Shader& clearComputeShader)
+void GpuGrid3D::setEmitters(const std::vector<Emitter>& emitters)
 {
-    clearComputeShader.use();
+    m_emitters = emitters;
+
+    std::vector<EmitterData> data;
+    data.reserve(emitters.size());
+    m_emitters_min = glm::vec3(1e30f);
+    m_emitters_max = glm::vec3(-1e30f);
+    for (const Emitter& emitter : emitters)
+    {
+        data.push_back(packEmitter(emitter));
+        glm::vec3 reach = emitterReach(emitter);
+        m_emitters_min = glm::min(m_emitters_min, emitter.position - reach);
+        m_emitters_max = glm::max(m_emitters_max, emitter.position + reach);
+    }
+
+    // after the brush's slot, the buffer only grows
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_emitterBuffer);
+    if ((int)data.size() + 1 > m_emitter_capacity)
+    {
+        m_emitter_capacity = (int)data.size() + 1;
+        glBufferData(GL_SHADER_STORAGE_BUFFER, m_emitter_capacity * sizeof(EmitterData), nullptr, GL_DYNAMIC_DRAW);
+    }
+    if (!data.empty())
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(EmitterData), data.size() * sizeof(EmitterData), data.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void GpuGrid3D::clear()
+{
+    ClearTarget texturesToClear[] = {
+        { m_densityTexA, &m_clearScalarShader, m_scalarFormat },
+        { m_densityTexB, &m_clearScalarShader, m_scalarFormat },
+        { m_velocityTexA, &m_clearVelocityShader, m_velocityFormat },
+        { m_velocityTexB, &m_clearVelocityShader, m_velocityFormat },
+        { m_divergenceTex, &m_clearScalarShader, m_scalarFormat },
+        { m_pressureTexA, &m_clearScalarShader, m_scalarFormat },
+        { m_pressureTexB, &m_clearScalarShader, m_scalarFormat }
+    };
+
+    for (const ClearTarget& target : texturesToClear)
+        clearBricks(target, m_allBricksBuffer);
+
+    // anything in flight was measured before the clear
+    dropMaxVelocityReadbacks();
+    m_max_velocity = 0.0f;
+    m_occupancy_dirty = true;
+    m_light_dirty = true;
+}
+
+void GpuGrid3D::clearBricks(const ClearTarget& target, GLuint brick_list)
+{
+    target.shader->use();
+
+    // bind tex to img unit0
+    glBindImageTexture(0, target.texture, 0, GL_TRUE, 0, GL_WRITE_ONLY, target.format);
+
+    // one group per brick of the list, 512 threads each (one for each 3D pixel)
+    dispatchBricks(brick_list);
+
+    // finish write
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+}
+
+void GpuGrid3D::dispatchBricks(GLuint brick_list)
+{
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, brick_list);
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, brick_list);
+    glDispatchComputeIndirect(0);
+}
+
+void GpuGrid3D::setSparseBricks(bool sparse, float threshold)
+{
+    if (sparse && !m_sparse_bricks)
+    {
+        // everything counts as active before the first step, which zeroes whatever isn't
+        GLuint one = 1;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_brickActiveBuffer);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &one);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    m_sparse_bricks = sparse;
+    m_brick_threshold = threshold;
+}
+
+int GpuGrid3D::getActiveBrickCount()
+{
+    if (!m_sparse_bricks)
+        return m_brick_count;
+
+    GLuint count = 0;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_activeBricksBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 3 * sizeof(GLuint), sizeof(GLuint), &count);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return (int)count;
+}
+
+void GpuGrid3D::updateActiveBricks()
+{
+    GLuint bricksX, bricksY, bricksZ;
+    getWorkGroups(bricksX, bricksY, bricksZ);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, m_activeBricksBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, m_clearedBricksBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, m_brickContentBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, m_brickActiveBuffer);
+
+    // flag the bricks with anything in them, after the splat
+    m_brickMarkShader.use();
+    glUniform1f(m_brickMarkShader.getUniformLocation("u_threshold"), m_brick_threshold);
+    glUniform3i(m_brickMarkShader.getUniformLocation("u_brickGrid"), bricksX, bricksY, bricksZ);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_3D, m_velocityTexA);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_3D, m_densityTexA);
+
+    glDispatchCompute(bricksX, bricksY, bricksZ);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    // dilate into the two lists, one thread per brick
+    m_brickCompactShader.use();
+    glUniform3i(m_brickCompactShader.getUniformLocation("u_brickGrid"), bricksX, bricksY, bricksZ);
+    glDispatchCompute((bricksX + 7) / 8, (bricksY + 7) / 8, (bricksZ + 7) / 8);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    m_brickArgsShader.use();
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+    // bricks that just went inactive (or inactive ones the splat wrote into) back to 0 in
+    // everything the stages write brick by brick, the stages read them as 0 from now on
+    ClearTarget droppedBricks[] = {
+        { m_densityTexA, &m_clearScalarShader, m_scalarFormat },
+        { m_densityTexB, &m_clearScalarShader, m_scalarFormat },
+        { m_velocityTexA, &m_clearVelocityShader, m_velocityFormat },
+        { m_velocityTexB, &m_clearVelocityShader, m_velocityFormat },
+        { m_velocityTexC, &m_clearVelocityShader, m_velocityFormat },
+        { m_divergenceTex, &m_clearScalarShader, m_scalarFormat }
+    };
+
+    for (const ClearTarget& target : droppedBricks)
+    {
+        if (target.texture != 0)
+            clearBricks(target, m_clearedBricksBuffer);
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+void GpuGrid3D::setLightVolume(bool enabled, int downsample)
+{
+    m_light_volume = enabled;
+    m_light_dirty = true;
+    if (!enabled)
+        return;
+
+    downsample = std::max(downsample, 1);
+    glm::ivec3 size((m_width + downsample - 1) / downsample, (m_height + downsample - 1) / downsample,
+        (m_depth + downsample - 1) / downsample);
+    if (m_lightTex != 0 && size.x == m_lightSize.x && size.y == m_lightSize.y && size.z == m_lightSize.z)
+        return;
+
+    // linear (create3DTexture's default), the raymarcher samples it between texels
+    glDeleteTextures(1, &m_lightTex);
+    m_lightSize = size;
+    m_lightTex = create3DTexture(GL_R32F, GL_RED, size.x, size.y, size.z);
+}
+
+void GpuGrid3D::setLightDirection(const glm::vec3& direction)
+{
+    glm::vec3 normalized = glm::normalize(direction);
+    if (normalized == m_light_direction)
+        return;
+
+    m_light_direction = normalized;
+    m_light_dirty = true;
+}
+
+void GpuGrid3D::updateLightVolume()
+{
+    if (!m_light_volume || !m_light_dirty)
+        return;
+    m_light_dirty = false;
+
+    m_lightShader.use();
+    glUniform3fv(m_lightShader.getUniformLocation("u_light_dir"), 1, glm::value_ptr(m_light_direction));
+    glUniform1f(m_lightShader.getUniformLocation("u_absorption"), m_light_absorption);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_3D, m_densityTexA);
+    glBindImageTexture(2, m_lightTex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R32F);
+
+    glDispatchCompute((m_lightSize.x + 7) / 8, (m_lightSize.y + 7) / 8, (m_lightSize.z + 7) / 8);
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+void GpuGrid3D::updateOccupancy()
+{
+    if (!m_occupancy_dirty)
+        return;
+    m_occupancy_dirty = false;
+
+    // one group per brick
+    m_occupancyShader.use();
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_3D, m_densityTexA);
+    glBindImageTexture(2, m_occupancyTex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R32F);
+
+    glDispatchCompute(m_occupancySize.x, m_occupancySize.y, m_occupancySize.z);
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+void GpuGrid3D::reduceMaxVelocity()
+{
+    collectMaxVelocity();
+
+    // gpu more than k_max_velocity_slots steps behind, skip this one rather than wait
+    int slot = m_max_velocity_slot;
+    if (m_max_velocity_fences[slot])
+        return;
+
+    GLuint zero = 0;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_maxVelocityBuffer);
+    glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, slot * sizeof(GLuint), sizeof(GLuint),
+        GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    m_maxVelocityShader.use();
+    glUniform1i(m_maxVelocityShader.getUniformLocation("u_slot"), slot);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_3D, m_velocityTexA);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_maxVelocityBuffer);
 
     GLuint workGroupsX, workGroupsY, workGroupsZ;
     getWorkGroups(workGroupsX, workGroupsY, workGroupsZ);
+    glDispatchCompute(workGroupsX, workGroupsY, workGroupsZ);
 
-    GLuint texturesToClear[] = {
-        m_densityTexA, m_densityTexB,
-        m_velocityTexA, m_velocityTexB,
-        m_divergenceTex, m_pressureTexA, m_pressureTexB
-    };
+    // make the atomics visible to the mapping, then fence
+    glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    m_max_velocity_fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    m_max_velocity_slot = (slot + 1) % k_max_velocity_slots;
+}
 
-    for (GLuint tex : texturesToClear)
+void GpuGrid3D::collectMaxVelocity()
+{
+    // oldest first, stop at the first one still running (the later ones are too)
+    for (int i = 0; i < k_max_velocity_slots; ++i)
     {
-        // bind tex to img unit0
-        glBindImageTexture(0, tex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+        int slot = (m_max_velocity_slot + i) % k_max_velocity_slots;
+        GLsync fence = m_max_velocity_fences[slot];
+        if (!fence)
+            continue;
+
+        GLint status = GL_UNSIGNALED;
+        glGetSynciv(fence, GL_SYNC_STATUS, 1, nullptr, &status);
+        if (status != GL_SIGNALED)
+            break;
+
+        GLuint bits = 0;
+        if (m_max_velocity_mapped)
+        {
+            bits = m_max_velocity_mapped[slot];
+        }
+        else
+        {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_maxVelocityBuffer);
+            glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, slot * sizeof(GLuint), sizeof(GLuint), &bits);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        }
 
-        // launch 16x16x16 = 4096 work groups
-        // 4096 * 512 = 2 097 152 threads (one for each 3D pixel)
-        glDispatchCompute(workGroupsX, workGroupsY, workGroupsZ);
+        std::memcpy(&m_max_velocity, &bits, sizeof(float));
+        glDeleteSync(fence);
+        m_max_velocity_fences[slot] = nullptr;
+    }
+}
 
-        // finish write
-        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+void GpuGrid3D::dropMaxVelocityReadbacks()
+{
+    for (GLsync& fence : m_max_velocity_fences)
+    {
+        if (fence)
+            glDeleteSync(fence);
+        fence = nullptr;
     }
 }
 
+int GpuGrid3D::cflSubsteps(float dt, float target_cfl, int max_substeps) const
+{
+    if (m_max_velocity < 0.0f || target_cfl <= 0.0f)
+        return 1;
+
+    // cells moved in one step of dt, nan / inf from a blown up field get the max too
+    float cells = m_max_velocity * dt;
+    if (!(cells <= target_cfl * max_substeps))
+        return max_substeps;
+
+    return std::max(1, (int)std::ceil(cells / target_cfl));
+}
+
 void GpuGrid3D::swapDensityBuffers()
 {
     std::swap(m_densityTexA, m_densityTexB);
@@ -86,211 +746,608 @@ void GpuGrid3D::swapVelocityBuffers()
     std::swap(m_velocityTexA, m_velocityTexB);
 }
 
-void GpuGrid3D::step(Shader& splatShader, Shader& advectShader, Shader& diffuseShader,
-    Shader& divergenceShader, Shader& pressureShader, Shader& gradientShader,
-    const glm::vec3& mouse_pos3D, const glm::vec3& mouse_vel,
-    bool is_bouncing, float dt,
-    float viscosity, int diffuse_iterations, int pressure_iterations)
+float GpuGrid3D::pressureResidual()
 {
-    splatShader.use();
+    m_residualShader.use();
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_3D, m_pressureTexA);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_3D, m_divergenceTex);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_residualBuffer);
 
     GLuint workGroupsX, workGroupsY, workGroupsZ;
     getWorkGroups(workGroupsX, workGroupsY, workGroupsZ);
+    glDispatchCompute(workGroupsX, workGroupsY, workGroupsZ);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
 
-    float brush_radius = m_width * 0.025f; // 2.5% of the obj
+    // waits for the gpu, only done every check interval
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_residualBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, m_residual_partials.size() * sizeof(glm::vec2), m_residual_partials.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-    // set const uniforms
-    glUniform3fv(glGetUniformLocation(splatShader.ID, "u_brush_center3D"), 1, glm::value_ptr(mouse_pos3D));
-    glUniform1f(glGetUniformLocation(splatShader.ID, "u_radius"), brush_radius);
-    glUniform1i(glGetUniformLocation(splatShader.ID, "u_is_bouncing"), is_bouncing ? 1 : 0);
+    double residual_sum = 0.0;
+    double rhs_sum = 0.0;
+    for (const glm::vec2& partial : m_residual_partials)
+    {
+        residual_sum += partial.x;
+        rhs_sum += partial.y;
+    }
 
-    // splat velo
-    glUniform3fv(glGetUniformLocation(splatShader.ID, "u_force"), 1, glm::value_ptr(mouse_vel));
+    // nothing to solve
+    if (rhs_sum <= 0.0)
+        return 0.0f;
 
-    // bind textures to img units - 0 (read) / 1 (write)
-    glBindImageTexture(0, m_velocityTexA, 0, GL_TRUE, 0, GL_READ_ONLY, GL_RGBA32F);
-    glBindImageTexture(1, m_velocityTexB, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    return (float)std::sqrt(residual_sum / rhs_sum);
+}
 
-    // launch comp shader
-    glDispatchCompute(workGroupsX, workGroupsY, workGroupsZ);
-    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT); // give it a moment
+void GpuGrid3D::jacobiTiled(Shader& shader, GLuint x_tex, GLuint b_tex, GLuint out_tex, GLenum format,
+    int iterations, float alpha, float r_beta, bool zero_guess, GLuint brick_list)
+{
+    shader.use();
+    glUniform1f(shader.getUniformLocation("u_alpha"), alpha);
+    glUniform1f(shader.getUniformLocation("u_rBeta"), r_beta);
+    glUniform1i(shader.getUniformLocation("u_iterations"), iterations);
+    glUniform1i(shader.getUniformLocation("u_zero_guess"), zero_guess ? 1 : 0);
 
-    swapVelocityBuffers(); // res->texA
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_3D, x_tex);
 
-    // splat dens
-    glUniform3f(glGetUniformLocation(splatShader.ID, "u_force"), 1.0f, 0.0f, 0.0f);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_3D, b_tex);
 
-    glBindImageTexture(0, m_densityTexA, 0, GL_TRUE, 0, GL_READ_ONLY, GL_RGBA32F);
-    glBindImageTexture(1, m_densityTexB, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glBindImageTexture(2, out_tex, 0, GL_TRUE, 0, GL_WRITE_ONLY, format);
 
-    glDispatchCompute(workGroupsX, workGroupsY, workGroupsZ);
-    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT); // *elevator music plays*
+    dispatchBricks(brick_list);
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+}
 
-    swapDensityBuffers(); // res->texA
+void GpuGrid3D::diffuseTiled(Shader& shader, GLuint& field, GLuint& temp, GLuint& scratch, GLenum format,
+    int tile_iterations, float alpha, float r_beta, int iterations)
+{
+    // b is the field before diffusing (like FluidGrid3D). the plain loop binds u_b to A,
+    // which its odd iterations overwrite, so the two paths don't match bit for bit
+    GLuint src = field;
+    GLuint dst = temp;
+    int done = 0;
+    while (done < iterations)
+    {
+        int batch = std::min(tile_iterations, iterations - done);
+        jacobiTiled(shader, src, field, dst, format, batch, alpha, r_beta, false, stageBricks());
+        done += batch;
 
-    // diffuse
-    diffuseShader.use();
+        src = dst;
+        dst = (dst == temp) ? scratch : temp;
+    }
 
-    // 6.0f
-    float vel_a = dt * viscosity * m_width * m_width;
-    float vel_rBeta = 1.0f / (1.0f + 6.0f * vel_a);
+    // result -> field, the old field becomes temp / scratch
+    if (src == temp)
+        std::swap(field, temp);
+    else if (src == scratch)
+        std::swap(field, scratch);
+}
 
-    float dens_a = dt * 0.00001f * m_width * m_width; // diff for smoke
-    float dens_rBeta = 1.0f / (1.0f + 6.0f * dens_a);
+void GpuGrid3D::createVelocityScratch()
+{
+    // third velocity texture, once the tiled diffuse takes more than one dispatch.
+    // zeroed, the sparse mode reads the inactive bricks around the active ones
+    if (m_velocityTexC != 0)
+        return;
+    m_velocityTexC = create3DTexture(m_velocityFormat, GL_RGBA);
+    clearBricks({ m_velocityTexC, &m_clearVelocityShader, m_velocityFormat }, m_allBricksBuffer);
+}
+
+void GpuGrid3D::diffuseVelocity(int iterations, float alpha, float r_beta)
+{
+    if (m_tiled_jacobi && iterations > 1)
+    {
+        if (iterations > m_velocityTileIterations)
+            createVelocityScratch();
+
+        diffuseTiled(m_jacobiTiledVelocityShader, m_velocityTexA, m_velocityTexB, m_velocityTexC,
+            m_velocityFormat, m_velocityTileIterations, alpha, r_beta, iterations);
+        return;
+    }
 
-    // diff velo
-    glUniform1f(glGetUniformLocation(diffuseShader.ID, "u_alpha"), vel_a);
-    glUniform1f(glGetUniformLocation(diffuseShader.ID, "u_rBeta"), vel_rBeta);
+    m_diffuseVelocityShader.use();
 
     glActiveTexture(GL_TEXTURE1);
     glBindTexture(GL_TEXTURE_3D, m_velocityTexA);
-    glUniform1i(glGetUniformLocation(diffuseShader.ID, "u_b"), 1);
 
-    for (int i = 0; i < diffuse_iterations; ++i)
+    for (int i = 0; i < iterations; ++i)
     {
         if (i % 2 == 0)
         {
             // Read from A (u_x), Write to B (u_writeTexture)
             glActiveTexture(GL_TEXTURE0);
             glBindTexture(GL_TEXTURE_3D, m_velocityTexA);
-            glUniform1i(glGetUniformLocation(diffuseShader.ID, "u_x"), 0);
-            glBindImageTexture(2, m_velocityTexB, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+            glBindImageTexture(2, m_velocityTexB, 0, GL_TRUE, 0, GL_WRITE_ONLY, m_velocityFormat);
         }
         else
         {
             // Read from B (u_x), Write to A (u_writeTexture)
             glActiveTexture(GL_TEXTURE0);
             glBindTexture(GL_TEXTURE_3D, m_velocityTexB);
-            glUniform1i(glGetUniformLocation(diffuseShader.ID, "u_x"), 0);
-            glBindImageTexture(2, m_velocityTexA, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+            glBindImageTexture(2, m_velocityTexA, 0, GL_TRUE, 0, GL_WRITE_ONLY, m_velocityFormat);
         }
-        glDispatchCompute(workGroupsX, workGroupsY, workGroupsZ);
+        dispatchBricks(stageBricks());
         glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
     }
     // i=18 (even): Read A, Write B
     // i=19 (odd):  Read B, Write A.
+}
 
-    // diff velo
-    glUniform1f(glGetUniformLocation(diffuseShader.ID, "u_alpha"), dens_a);
-    glUniform1f(glGetUniformLocation(diffuseShader.ID, "u_rBeta"), dens_rBeta);
+void GpuGrid3D::diffuseDensity(int iterations, float alpha, float r_beta)
+{
+    // the divergence texture is free until the divergence pass
+    if (m_tiled_jacobi && iterations > 1)
+    {
+        diffuseTiled(m_jacobiTiledScalarShader, m_densityTexA, m_densityTexB, m_divergenceTex,
+            m_scalarFormat, m_scalarTileIterations, alpha, r_beta, iterations);
+        return;
+    }
+
+    m_diffuseScalarShader.use();
 
     glActiveTexture(GL_TEXTURE1);
     glBindTexture(GL_TEXTURE_3D, m_densityTexA);
-    glUniform1i(glGetUniformLocation(diffuseShader.ID, "u_b"), 1);
 
-    for (int i = 0; i < diffuse_iterations; ++i)
+    for (int i = 0; i < iterations; ++i)
     {
         if (i % 2 == 0) {
             glActiveTexture(GL_TEXTURE0);
             glBindTexture(GL_TEXTURE_3D, m_densityTexA);
-            glUniform1i(glGetUniformLocation(diffuseShader.ID, "u_x"), 0);
-            glBindImageTexture(2, m_densityTexB, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+            glBindImageTexture(2, m_densityTexB, 0, GL_TRUE, 0, GL_WRITE_ONLY, m_scalarFormat);
         }
         else {
             glActiveTexture(GL_TEXTURE0);
             glBindTexture(GL_TEXTURE_3D, m_densityTexB);
-            glUniform1i(glGetUniformLocation(diffuseShader.ID, "u_x"), 0);
-            glBindImageTexture(2, m_densityTexA, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+            glBindImageTexture(2, m_densityTexA, 0, GL_TRUE, 0, GL_WRITE_ONLY, m_scalarFormat);
         }
-        glDispatchCompute(workGroupsX, workGroupsY, workGroupsZ);
+        dispatchBricks(stageBricks());
         glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
     }
+}
 
-    // divergence, pressure, gradient
-    divergenceShader.use();
-    glUniform3f(glGetUniformLocation(divergenceShader.ID, "u_gridSize"), (float)m_width, (float)m_height, (float)m_depth);
+void GpuGrid3D::diffuseFused(int iterations)
+{
+    // same ping-pong as diffuseVelocity / diffuseDensity, both fields per dispatch.
+    // alpha / rBeta per field come from the step uniforms
+    if (m_tiled_jacobi && iterations > 1)
+    {
+        if (iterations > m_velocityTileIterations)
+            createVelocityScratch();
+
+        // b is the field before diffusing, velocity goes A -> B / C, density A -> B / divergence
+        GLuint velocity_src = m_velocityTexA, velocity_dst = m_velocityTexB;
+        GLuint density_src = m_densityTexA, density_dst = m_densityTexB;
+
+        m_jacobiTiledFusedShader.use();
+        glUniform1i(m_jacobiTiledFusedShader.getUniformLocation("u_zero_guess"), 0);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_3D, m_velocityTexA);
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_3D, m_densityTexA);
+
+        int done = 0;
+        while (done < iterations)
+        {
+            // tiles hold a vec4 per cell, the velocity batch size
+            int batch = std::min(m_velocityTileIterations, iterations - done);
+            glUniform1i(m_jacobiTiledFusedShader.getUniformLocation("u_iterations"), batch);
 
-    glActiveTexture(GL_TEXTURE0);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_3D, velocity_src);
+            glActiveTexture(GL_TEXTURE2);
+            glBindTexture(GL_TEXTURE_3D, density_src);
+            glBindImageTexture(2, velocity_dst, 0, GL_TRUE, 0, GL_WRITE_ONLY, m_velocityFormat);
+            glBindImageTexture(3, density_dst, 0, GL_TRUE, 0, GL_WRITE_ONLY, m_scalarFormat);
+
+            dispatchBricks(stageBricks());
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+            done += batch;
+
+            velocity_src = velocity_dst;
+            velocity_dst = (velocity_dst == m_velocityTexB) ? m_velocityTexC : m_velocityTexB;
+            density_src = density_dst;
+            density_dst = (density_dst == m_densityTexB) ? m_divergenceTex : m_densityTexB;
+        }
+        glActiveTexture(GL_TEXTURE0);
+
+        // results -> A, like diffuseTiled
+        if (velocity_src == m_velocityTexB)
+            std::swap(m_velocityTexA, m_velocityTexB);
+        else if (velocity_src == m_velocityTexC)
+            std::swap(m_velocityTexA, m_velocityTexC);
+
+        if (density_src == m_densityTexB)
+            std::swap(m_densityTexA, m_densityTexB);
+        else if (density_src == m_divergenceTex)
+            std::swap(m_densityTexA, m_divergenceTex);
+        return;
+    }
+
+    m_diffuseFusedShader.use();
+
+    glActiveTexture(GL_TEXTURE1);
     glBindTexture(GL_TEXTURE_3D, m_velocityTexA);
-    glUniform1i(glGetUniformLocation(divergenceShader.ID, "u_velocityField"), 0);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_3D, m_densityTexA);
 
-    glBindImageTexture(2, m_divergenceTex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    for (int i = 0; i < iterations; ++i)
+    {
+        // even: A -> B, odd: B -> A, for both fields
+        bool even = i % 2 == 0;
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_3D, even ? m_velocityTexA : m_velocityTexB);
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_3D, even ? m_densityTexA : m_densityTexB);
+        glBindImageTexture(2, even ? m_velocityTexB : m_velocityTexA, 0, GL_TRUE, 0, GL_WRITE_ONLY, m_velocityFormat);
+        glBindImageTexture(3, even ? m_densityTexB : m_densityTexA, 0, GL_TRUE, 0, GL_WRITE_ONLY, m_scalarFormat);
+
+        dispatchBricks(stageBricks());
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
+    glActiveTexture(GL_TEXTURE0);
+}
 
-    glDispatchCompute(workGroupsX, workGroupsY, workGroupsZ);
-    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+void GpuGrid3D::solvePressureJacobi(int max_iterations)
+{
+    GLuint workGroupsX, workGroupsY, workGroupsZ;
+    getWorkGroups(workGroupsX, workGroupsY, workGroupsZ);
 
-    // pressure
-    pressureShader.use();
+    // result always ends up in A (the old loop left odd iteration counts in B)
+    m_last_pressure_residual = -1.0f;
+    bool check_residual = m_pressure_tolerance > 0.0f;
+    int check_interval = m_pressure_check_interval > 0 ? m_pressure_check_interval : 1;
 
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_3D, m_divergenceTex);
-    glUniform1i(glGetUniformLocation(pressureShader.ID, "u_divergence"), 1);
+    // a warm start may already be good enough
+    int iterations = 0;
+    if (check_residual && m_pressure_warm_start)
+    {
+        m_last_pressure_residual = pressureResidual();
+        if (m_last_pressure_residual <= m_pressure_tolerance)
+            max_iterations = 0;
+    }
 
-    for (int i = 0; i < pressure_iterations; ++i)
+    while (iterations < max_iterations)
     {
-        if (i % 2 == 0)
+        // iterations up to the next residual check, the tiled kernel does them in one dispatch
+        int batch = max_iterations - iterations;
+        if (check_residual)
+            batch = std::min(batch, check_interval - iterations % check_interval);
+        if (m_tiled_jacobi)
+            batch = std::min(batch, m_scalarTileIterations);
+        else
+            batch = 1;
+
+        // cold start: first iteration ignores the old pressure
+        bool zero_guess = iterations == 0 && !m_pressure_warm_start;
+
+        if (batch > 1)
         {
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_3D, m_pressureTexA);
-            glUniform1i(glGetUniformLocation(pressureShader.ID, "u_pressure"), 0);
-            glBindImageTexture(2, m_pressureTexB, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+            jacobiTiled(m_jacobiTiledScalarShader, m_pressureTexA, m_divergenceTex, m_pressureTexB,
+                m_scalarFormat, batch, 1.0f, 1.0f / 6.0f, zero_guess, m_allBricksBuffer);
         }
         else
         {
+            m_pressureShader.use();
+
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_3D, m_divergenceTex);
+
+            glUniform1i(m_pressureShader.getUniformLocation("u_zero_guess"), zero_guess ? 1 : 0);
+
             glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_3D, m_pressureTexB);
-            glUniform1i(glGetUniformLocation(pressureShader.ID, "u_pressure"), 0);
-            glBindImageTexture(2, m_pressureTexA, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+            glBindTexture(GL_TEXTURE_3D, m_pressureTexA);
+            glBindImageTexture(2, m_pressureTexB, 0, GL_TRUE, 0, GL_WRITE_ONLY, m_scalarFormat);
+
+            glDispatchCompute(workGroupsX, workGroupsY, workGroupsZ);
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        }
+        std::swap(m_pressureTexA, m_pressureTexB);
+        iterations += batch;
+
+        if (check_residual && (iterations % check_interval == 0 || iterations == max_iterations))
+        {
+            m_last_pressure_residual = pressureResidual();
+            if (m_last_pressure_residual <= m_pressure_tolerance)
+                break;
         }
-        glDispatchCompute(workGroupsX, workGroupsY, workGroupsZ);
-        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
     }
+    m_last_pressure_iterations = iterations;
+}
+
+void GpuGrid3D::dispatch(int width, int height, int depth)
+{
+    glDispatchCompute((width + 7) / 8, (height + 7) / 8, (depth + 7) / 8);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+}
+
+void GpuGrid3D::setMultigridUniforms(Shader& shader, const MultigridLevel& level)
+{
+    shader.use();
+    glUniform3i(shader.getUniformLocation("u_gridSize"), level.width, level.height, level.depth);
+    glUniform3fv(shader.getUniformLocation("u_ghostLow"), 1, glm::value_ptr(level.ghostLow));
+    glUniform3fv(shader.getUniformLocation("u_ghostHigh"), 1, glm::value_ptr(level.ghostHigh));
+}
+
+void GpuGrid3D::multigridSmooth(const MultigridLevel& level, int sweeps)
+{
+    setMultigridUniforms(m_mgSmoothShader, level);
+    glBindImageTexture(0, level.pressureTex, 0, GL_TRUE, 0, GL_READ_WRITE, GL_R32F);
+    glBindImageTexture(1, level.rhsTex, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32F);
+
+    // red-black gauss-seidel, one dispatch per color, half the cells each
+    GLint color_location = m_mgSmoothShader.getUniformLocation("u_color");
+    for (int k = 0; k < sweeps; ++k)
+    {
+        for (int color = 0; color < 2; ++color)
+        {
+            glUniform1i(color_location, color);
+            dispatch((level.width + 1) / 2, level.height, level.depth);
+        }
+    }
+}
+
+void GpuGrid3D::multigridVCycle(int level_index)
+{
+    const MultigridLevel& level = m_multigrid_levels[level_index];
+
+    // coarsest, just smooth it out (dirichlet, no null space to deal with)
+    if (level_index == (int)m_multigrid_levels.size() - 1)
+    {
+        multigridSmooth(level, m_multigrid_coarse_smoothing);
+        return;
+    }
+
+    const MultigridLevel& coarse = m_multigrid_levels[level_index + 1];
+
+    multigridSmooth(level, m_multigrid_smoothing);
+
+    // residual -> coarse rhs, coarse error = 0
+    setMultigridUniforms(m_mgRestrictShader, level);
+    glUniform3i(m_mgRestrictShader.getUniformLocation("u_coarseSize"), coarse.width, coarse.height, coarse.depth);
+    glBindImageTexture(0, level.pressureTex, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32F);
+    glBindImageTexture(1, level.rhsTex, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32F);
+    glBindImageTexture(2, coarse.rhsTex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R32F);
+    glBindImageTexture(3, coarse.pressureTex, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R32F);
+    dispatch(coarse.width, coarse.height, coarse.depth);
+
+    multigridVCycle(level_index + 1);
+
+    // p += trilinear(coarse error)
+    setMultigridUniforms(m_mgProlongShader, level);
+    glUniform3i(m_mgProlongShader.getUniformLocation("u_coarseSize"), coarse.width, coarse.height, coarse.depth);
+    glUniform3fv(m_mgProlongShader.getUniformLocation("u_coarseGhostLow"), 1, glm::value_ptr(coarse.ghostLow));
+    glUniform3fv(m_mgProlongShader.getUniformLocation("u_coarseGhostHigh"), 1, glm::value_ptr(coarse.ghostHigh));
+    glBindImageTexture(0, level.pressureTex, 0, GL_TRUE, 0, GL_READ_WRITE, GL_R32F);
+    glBindImageTexture(3, coarse.pressureTex, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32F);
+    dispatch(level.width, level.height, level.depth);
+
+    multigridSmooth(level, m_multigrid_smoothing);
+}
+
+void GpuGrid3D::solvePressureMultigrid()
+{
+    m_last_pressure_residual = -1.0f;
+    bool check_residual = m_pressure_tolerance > 0.0f;
+
+    // cold start from zero
+    if (!m_pressure_warm_start)
+    {
+        m_clearScalarShader.use();
+        glBindImageTexture(0, m_pressureTexA, 0, GL_TRUE, 0, GL_WRITE_ONLY, m_scalarFormat);
+        dispatch(m_width, m_height, m_depth);
+    }
+
+    // the finest level works in place on pressure A
+    m_multigrid_levels[0].pressureTex = m_pressureTexA;
+    m_multigrid_levels[0].rhsTex = m_divergenceTex;
+
+    int cycles = 0;
+    while (cycles < m_multigrid_cycles)
+    {
+        // reads back every cycle, a cycle costs a lot more than a jacobi iteration anyway
+        if (check_residual)
+        {
+            glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+            m_last_pressure_residual = pressureResidual();
+            if (m_last_pressure_residual <= m_pressure_tolerance)
+                break;
+        }
+
+        multigridVCycle(0);
+        ++cycles;
+    }
+
+    if (check_residual && cycles == m_multigrid_cycles)
+    {
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        m_last_pressure_residual = pressureResidual();
+    }
+    m_last_pressure_iterations = cycles;
+
+    // gradient.comp samples the result
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+}
+
+void GpuGrid3D::step(const glm::vec3& mouse_pos3D, const glm::vec3& mouse_vel,
+    bool is_bouncing, float dt,
+    float viscosity, int diffuse_iterations, int pressure_iterations)
+{
+    float brush_radius = m_width * 0.025f; // 2.5% of the obj
+
+    // 6.0f
+    float vel_a = dt * viscosity * m_width * m_width;
+    float vel_rBeta = 1.0f / (1.0f + 6.0f * vel_a);
+
+    float dens_a = dt * 0.00001f * m_width * m_width; // diff for smoke
+    float dens_rBeta = 1.0f / (1.0f + 6.0f * dens_a);
+
+    // everything constant for the step goes up in one buffer update
+    StepUniforms step_uniforms;
+    step_uniforms.gridSize = glm::vec4((float)m_width, (float)m_height, (float)m_depth, 0.0f);
+    step_uniforms.diffusion = glm::vec4(vel_a, vel_rBeta, dens_a, dens_rBeta);
+    step_uniforms.dt = dt;
+
+    glBindBuffer(GL_UNIFORM_BUFFER, m_stepUniformBuffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(StepUniforms), &step_uniforms);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, m_stepUniformBuffer);
+
+    m_profiler.beginFrame();
+
+    // splat: the brush and the emitters in one dispatch, only over their bounds
+    m_profiler.beginStage("splat");
+    {
+        // the brush is a point emitter adding a weight of 1 (and mouse_vel) per step. its rate
+        // is per second, so a step without time (or going backwards) leaves it out
+        bool splat_brush = is_bouncing && dt > 0.0f;
+        Emitter brush;
+        brush.shape = EmitterShape::Point;
+        brush.position = mouse_pos3D;
+        brush.size = glm::vec3(brush_radius);
+        brush.rate = splat_brush ? 1.0f / dt : 0.0f;
+        brush.force = splat_brush ? mouse_vel / dt : glm::vec3(0.0f);
+
+        glm::vec3 union_min = m_emitters_min;
+        glm::vec3 union_max = m_emitters_max;
+        if (splat_brush)
+        {
+            EmitterData brush_data = packEmitter(brush);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_emitterBuffer);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(EmitterData), &brush_data);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+            glm::vec3 reach = emitterReach(brush);
+            union_min = m_emitters.empty() ? brush.position - reach : glm::min(union_min, brush.position - reach);
+            union_max = m_emitters.empty() ? brush.position + reach : glm::max(union_max, brush.position + reach);
+        }
+
+        // clamped to the grid before it goes to int, emitters can be far outside
+        glm::vec3 grid_size((float)m_width, (float)m_height, (float)m_depth);
+        glm::ivec3 box_min = glm::ivec3(glm::floor(glm::clamp(union_min, glm::vec3(0.0f), grid_size)));
+        glm::ivec3 box_max = glm::ivec3(glm::ceil(glm::clamp(union_max + 1.0f, glm::vec3(0.0f), grid_size)));
+        glm::ivec3 box_size = box_max - box_min;
+
+        // nothing emitting, no time to emit in, or all of it outside the grid
+        bool emitting = dt > 0.0f && (splat_brush || !m_emitters.empty());
+        if (emitting && box_size.x > 0 && box_size.y > 0 && box_size.z > 0)
+        {
+            m_splatShader.use();
+            glUniform3i(m_splatShader.getUniformLocation("u_boxMin"), box_min.x, box_min.y, box_min.z);
+            glUniform3i(m_splatShader.getUniformLocation("u_boxMax"), box_max.x, box_max.y, box_max.z);
+            glUniform1i(m_splatShader.getUniformLocation("u_firstEmitter"), splat_brush ? 0 : 1);
+            glUniform1i(m_splatShader.getUniformLocation("u_emitterCount"), 1 + (int)m_emitters.size());
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, m_emitterBuffer);
+
+            // in place, no ping-pong
+            glBindImageTexture(0, m_velocityTexA, 0, GL_TRUE, 0, GL_READ_WRITE, m_velocityFormat);
+            glBindImageTexture(1, m_densityTexA, 0, GL_TRUE, 0, GL_READ_WRITE, m_scalarFormat);
+
+            glDispatchCompute((box_size.x + 7) / 8, (box_size.y + 7) / 8, (box_size.z + 7) / 8);
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+        }
+    }
+
+    // sparse: which bricks the rest of the step runs on
+    if (m_sparse_bricks)
+    {
+        m_profiler.beginStage("bricks");
+        updateActiveBricks();
+    }
+
+    // diffuse. a field whose alpha isn't above the skip threshold (by default: is 0) is left
+    // as it is, with both fields going one set of dispatches does them together
+    m_profiler.beginStage("diffuse");
+    bool diffuse_velocity = diffuse_iterations > 0 && vel_a > m_diffuse_skip_alpha;
+    bool diffuse_density = diffuse_iterations > 0 && dens_a > m_diffuse_skip_alpha;
+    if (diffuse_velocity && diffuse_density)
+        diffuseFused(diffuse_iterations);
+    else if (diffuse_velocity)
+        diffuseVelocity(diffuse_iterations, vel_a, vel_rBeta);
+    else if (diffuse_density)
+        diffuseDensity(diffuse_iterations, dens_a, dens_rBeta);
+
+    // divergence, pressure, gradient
+    m_profiler.beginStage("divergence");
+    m_divergenceShader.use();
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_3D, m_velocityTexA);
+
+    glBindImageTexture(2, m_divergenceTex, 0, GL_TRUE, 0, GL_WRITE_ONLY, m_scalarFormat);
+
+    dispatchBricks(stageBricks());
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+
+    // pressure
+    m_profiler.beginStage("pressure");
+    if (m_pressure_solver == PressureSolver::Multigrid)
+        solvePressureMultigrid();
+    else
+        solvePressureJacobi(pressure_iterations);
 
     // gradient
-    gradientShader.use();
-    glUniform3f(glGetUniformLocation(gradientShader.ID, "u_gridSize"), (float)m_width, (float)m_height, (float)m_depth);
+    m_profiler.beginStage("gradient");
+    m_gradientShader.use();
 
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_3D, m_velocityTexA);
-    glUniform1i(glGetUniformLocation(gradientShader.ID, "u_velocityField"), 0);
 
     glActiveTexture(GL_TEXTURE1);
     glBindTexture(GL_TEXTURE_3D, m_pressureTexA);
-    glUniform1i(glGetUniformLocation(gradientShader.ID, "u_pressureField"), 1);
 
-    glBindImageTexture(2, m_velocityTexB, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F); // Write to velocity B
+    glBindImageTexture(2, m_velocityTexB, 0, GL_TRUE, 0, GL_WRITE_ONLY, m_velocityFormat); // Write to velocity B
 
-    glDispatchCompute(workGroupsX, workGroupsY, workGroupsZ);
+    dispatchBricks(stageBricks());
     glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
     swapVelocityBuffers();
 
     // advect
-    advectShader.use();
-
-    glUniform3f(glGetUniformLocation(advectShader.ID, "u_gridSize"), (float)m_width, (float)m_height, (float)m_depth);
-    glUniform1f(glGetUniformLocation(advectShader.ID, "u_dt"), dt);
-
     // adv velo
+    m_profiler.beginStage("advect");
+    m_advectVelocityShader.use();
+
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_3D, m_velocityTexA);
-    glUniform1i(glGetUniformLocation(advectShader.ID, "u_velocityField_sampler"), 0);
 
     glActiveTexture(GL_TEXTURE1);
     glBindTexture(GL_TEXTURE_3D, m_velocityTexA);
-    glUniform1i(glGetUniformLocation(advectShader.ID, "u_quantityToMove_sampler"), 1);
 
-    glBindImageTexture(2, m_velocityTexB, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glBindImageTexture(2, m_velocityTexB, 0, GL_TRUE, 0, GL_WRITE_ONLY, m_velocityFormat);
 
-    glDispatchCompute(workGroupsX, workGroupsY, workGroupsZ);
+    dispatchBricks(stageBricks());
     glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
     swapVelocityBuffers(); // res->veloTexA
 
     // adv dens
+    m_advectScalarShader.use();
 
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_3D, m_velocityTexA);
-    glUniform1i(glGetUniformLocation(advectShader.ID, "u_velocityField_sampler"), 0);
 
     glActiveTexture(GL_TEXTURE1);
     glBindTexture(GL_TEXTURE_3D, m_densityTexA);
-    glUniform1i(glGetUniformLocation(advectShader.ID, "u_quantityToMove_sampler"), 1);
 
-    glBindImageTexture(2, m_densityTexB, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+    glBindImageTexture(2, m_densityTexB, 0, GL_TRUE, 0, GL_WRITE_ONLY, m_scalarFormat);
 
-    glDispatchCompute(workGroupsX, workGroupsY, workGroupsZ);
+    dispatchBricks(stageBricks());
     glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
     swapDensityBuffers(); // res->densTexA
+    m_occupancy_dirty = true;
+    m_light_dirty = true;
+
+    if (m_max_velocity_reduction)
+    {
+        m_profiler.beginStage("max velocity");
+        reduceMaxVelocity();
+    }
 
+    m_profiler.endFrame();
 
 
 
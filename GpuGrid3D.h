@@ -1,36 +1,143 @@
 #pragma once
 #include <glad/glad.h>
 #include "shader.h"
+#include "GpuProfiler.h"
+#include "Emitter.h"
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <vector>
 
 class GpuGrid3D
 {
 public:
-	GpuGrid3D(int width, int height, int depth);
+	enum class PressureSolver
+	{
+		Jacobi,     // pressure_iterations jacobi iterations (pressure.comp / jacobi_tiled.comp)
+		Multigrid   // V-cycles over a chain of halved textures (multigrid.comp)
+	};
+
+	// scalar fields (density, divergence, pressure) are GL_R32F, velocity is GL_RGBA16F or
+	// GL_RGBA32F. the compute programs are built per format (IMAGE_FORMAT in the .comp files)
+	GpuGrid3D(int width, int height, int depth, GLenum velocity_format = GL_RGBA32F);
 	~GpuGrid3D();
 
-	void step(Shader& splatShader, Shader& advectShader, Shader& diffuseShader,
-		Shader& divergenceShader, Shader& pressureShader, Shader& gradientShader,
-		const glm::vec3& mouse_pos3D, const glm::vec3& mouse_vel,
+	// pressure_iterations is the max, fewer run once the pressure tolerance is met.
+	// the multigrid solver ignores it and runs its V-cycle count instead
+	void step(const glm::vec3& mouse_pos3D, const glm::vec3& mouse_vel,
 		bool is_bouncing, float dt,
 		float viscosity, int diffuse_iterations, int pressure_iterations);
 
-	void clear(Shader& clearComputeShader);
+	// smoke sources next to the mouse brush, all applied by one splat.comp dispatch per step over
+	// the union of their bounds. the list is uploaded here, step only updates the brush's slot
+	void setEmitters(const std::vector<Emitter>& emitters);
+	const std::vector<Emitter>& getEmitters() const { return m_emitters; }
+
+	void clear();
 
 	void swapDensityBuffers();
 	void swapVelocityBuffers();
 
 	GLuint getDensityTexture() { return m_densityTexA; }
 	GLuint getVelocityTexture() { return m_velocityTexA; }
+	GLenum getVelocityFormat() const { return m_velocityFormat; }
+
+	// max density per k_brick_size^3 brick (apron included, see occupancy.comp), GL_R32F with
+	// ceil(size / 8) texels per axis. updateOccupancy rebuilds it if a step ran since the last
+	// call, once before rendering costs one pass per frame however many steps the frame took
+	void updateOccupancy();
+	GLuint getOccupancyTexture() { return m_occupancyTex; }
+	glm::ivec3 getOccupancySize() const { return m_occupancySize; }
+	static const int k_brick_size = 8;
+
+	// light transmittance toward a directional light (light.comp), GL_R32F at
+	// ceil(size / downsample) per axis, sampled once per raymarch sample instead of a shadow march.
+	// direction is in model space, pointing at the light. updateLightVolume rebuilds it if a
+	// step ran or the light changed since the last call, nothing while it's off
+	void setLightVolume(bool enabled, int downsample = 2);
+	bool getLightVolume() const { return m_light_volume; }
+	void setLightDirection(const glm::vec3& direction);
+	void setLightAbsorption(float absorption) { m_light_absorption = absorption; m_light_dirty = true; }
+	void updateLightVolume();
+	GLuint getLightTexture() { return m_lightTex; }
+
+	// sparse compute: after the splat, brick_activity.comp lists the 8^3 bricks with density or
+	// |velocity| above threshold, dilated by one brick, and diffuse / divergence / gradient /
+	// advect only run on those (glDispatchComputeIndirect over the list). bricks that drop out
+	// get zeroed, and so do inactive ones the splat left a sub-threshold tail in, so everything
+	// outside the list stays 0. storage is still dense (no brick atlas yet), and the
+	// pressure solve still covers the whole grid, its gradient outside the list is dropped
+	void setSparseBricks(bool sparse, float threshold = 1e-3f);
+	bool getSparseBricks() const { return m_sparse_bricks; }
+	// bricks the last step ran on, waits for the gpu (stats only)
+	int getActiveBrickCount();
+	int getBrickCount() const { return m_brick_count; }
+
+	// start each pressure solve from last step's pressure instead of zero
+	void setPressureWarmStart(bool warm_start) { m_pressure_warm_start = warm_start; }
+	bool getPressureWarmStart() const { return m_pressure_warm_start; }
+
+	// stop the pressure iterations once ||r|| <= tolerance * ||divergence||. the residual
+	// is read back every check_interval iterations (a sync). 0 runs the full count, no readback
+	void setPressureTolerance(float tolerance) { m_pressure_tolerance = tolerance; }
+	void setPressureCheckInterval(int check_interval) { m_pressure_check_interval = check_interval; }
+
+	void setPressureSolver(PressureSolver solver) { m_pressure_solver = solver; }
+	PressureSolver getPressureSolver() const { return m_pressure_solver; }
+
+	// multigrid: V-cycles per step (the max when a tolerance is set) and red-black
+	// gauss-seidel sweeps before and after each coarse correction
+	void setMultigridCycles(int cycles) { m_multigrid_cycles = cycles; }
+	void setMultigridSmoothing(int sweeps) { m_multigrid_smoothing = sweeps; }
+	int getMultigridCycles() const { return m_multigrid_cycles; }
+	int getMultigridSmoothing() const { return m_multigrid_smoothing; }
+	int getMultigridLevelCount() const { return (int)m_multigrid_levels.size(); }
+
+	// jacobi iterations (V-cycles for multigrid) and relative residual (-1 if not measured)
+	// of the last pressure solve
+	int getLastPressureIterations() const { return m_last_pressure_iterations; }
+	float getLastPressureResidual() const { return m_last_pressure_residual; }
+
+	// run diffuse / pressure batches through jacobi_tiled.comp (several iterations per
+	// dispatch out of shared memory) instead of one diffuse.comp / pressure.comp dispatch each
+	void setTiledJacobi(bool tiled) { m_tiled_jacobi = tiled; }
+	bool getTiledJacobi() const { return m_tiled_jacobi; }
+
+	// a field whose diffusion alpha (dt * rate * width^2) is at or below this skips its
+	// diffuse solve. the default 0 only skips a field with nothing to diffuse (alpha 0, the
+	// solve would hand back its input), any viscosity the caller passes is diffused. opt in
+	// to more for speed, at the app's 64^3 both alphas are below 1e-3. with both fields
+	// diffused, one set of dispatches (diffuse.comp / jacobi_tiled.comp FUSED) does both
+	void setDiffuseSkipAlpha(float alpha) { m_diffuse_skip_alpha = alpha; }
+	float getDiffuseSkipAlpha() const { return m_diffuse_skip_alpha; }
+
+	// iterations one tiled dispatch runs, picked from GL_MAX_COMPUTE_SHARED_MEMORY_SIZE
+	int getScalarTileIterations() const { return m_scalarTileIterations; }
+	int getVelocityTileIterations() const { return m_velocityTileIterations; }
+
+	// gpu time per stage of step (splat, diffuse, divergence, pressure, gradient,
+	// advect), off until getProfiler().setEnabled(true)
+	GpuProfiler& getProfiler() { return m_profiler; }
+
+	// max |velocity| (cells per unit time) after a recent step. reduced on the gpu at the end
+	// of every step and read back a few steps later (persistent mapped buffer + fence), so it
+	// never waits. -1 until the first result is in
+	void setMaxVelocityReduction(bool enabled) { m_max_velocity_reduction = enabled; }
+	float getMaxVelocity() const { return m_max_velocity; }
+
+	// substeps a step of dt needs so no cell moves more than target_cfl cells per substep,
+	// from getMaxVelocity. 1 while there is no result yet, at most max_substeps
+	int cflSubsteps(float dt, float target_cfl, int max_substeps) const;
 
 public:
 	int m_width, m_height, m_depth;
 
+	GLenum m_scalarFormat;
+	GLenum m_velocityFormat;
+
 	// ping-pong buffers (single R comp)
 	GLuint m_densityTexA, m_densityTexB;
 
-	// ping-pong buffers (3 comp: r,g,b)
+	// ping-pong buffers (3 comp: r,g,b, stored rgba)
 	GLuint m_velocityTexA, m_velocityTexB;
 
 	// divergence
@@ -39,8 +146,159 @@ public:
 	// pressure
 	GLuint m_pressureTexA, m_pressureTexB;
 
+	// residual partial sums, one vec2 per work group
+	GLuint m_residualBuffer;
+
+	// third velocity texture for the tiled diffuse, made on first use
+	GLuint m_velocityTexC;
+
+	// StepUniforms (GpuGrid3D.cpp), uniform buffer binding 0
+	GLuint m_stepUniformBuffer;
+
+	// emitters (EmitterData), storage buffer binding 7. [0] is the mouse brush
+	GLuint m_emitterBuffer;
+
+	// max |velocity| ring (one uint per step in flight), storage buffer binding 1
+	GLuint m_maxVelocityBuffer;
+
+	// max density per brick, for the raymarcher
+	GLuint m_occupancyTex;
+	glm::ivec3 m_occupancySize;
+
+	// light transmittance, made by setLightVolume
+	GLuint m_lightTex;
+	glm::ivec3 m_lightSize;
+
 private:
+	// std430 mirror of EmitterData in splat.comp
+	struct EmitterData
+	{
+		glm::vec4 position; // xyz, w shape
+		glm::vec4 size;     // xyz, w rate
+		glm::vec4 force;    // xyz
+	};
+	static EmitterData packEmitter(const Emitter& emitter);
+
+	struct MultigridLevel
+	{
+		int width, height, depth;
+		GLuint pressureTex; // the error on coarse levels
+		GLuint rhsTex;
+		glm::vec3 ghostLow, ghostHigh; // see multigrid.comp
+	};
+
+	int m_scalarTileIterations;
+	int m_velocityTileIterations;
+
+	// compute programs, one per image format they write
+	Shader m_splatShader; // velocity and density together
+	Shader m_diffuseScalarShader, m_diffuseVelocityShader, m_diffuseFusedShader;
+	Shader m_advectScalarShader, m_advectVelocityShader;
+	Shader m_clearScalarShader, m_clearVelocityShader;
+	Shader m_divergenceShader;
+	Shader m_pressureShader;
+	Shader m_gradientShader;
+	Shader m_residualShader;
+	Shader m_jacobiTiledScalarShader, m_jacobiTiledVelocityShader, m_jacobiTiledFusedShader;
+	Shader m_mgSmoothShader, m_mgRestrictShader, m_mgProlongShader;
+	Shader m_maxVelocityShader;
+	Shader m_occupancyShader;
+	Shader m_lightShader;
+	Shader m_brickMarkShader, m_brickCompactShader, m_brickArgsShader;
+
+	bool m_tiled_jacobi;
+	float m_diffuse_skip_alpha;
+	PressureSolver m_pressure_solver;
+	int m_multigrid_cycles;
+	int m_multigrid_smoothing;
+	int m_multigrid_coarse_smoothing;
+
+	// [0] is the grid itself (pressure A / divergence, set per solve), textures from [1] on
+	std::vector<MultigridLevel> m_multigrid_levels;
+
+	bool m_pressure_warm_start;
+	float m_pressure_tolerance;
+	int m_pressure_check_interval;
+	int m_last_pressure_iterations;
+	float m_last_pressure_residual;
+	std::vector<glm::vec2> m_residual_partials;
+
+	GpuProfiler m_profiler;
+
+	static const int k_max_velocity_slots = 4;
+	bool m_max_velocity_reduction;
+	float m_max_velocity;
+	GLuint* m_max_velocity_mapped; // persistent mapping, null without ARB_buffer_storage
+	GLsync m_max_velocity_fences[k_max_velocity_slots];
+	int m_max_velocity_slot; // next slot to write, also the oldest in flight
+
+	std::vector<Emitter> m_emitters;
+	int m_emitter_capacity; // EmitterData slots in m_emitterBuffer
+	glm::vec3 m_emitters_min, m_emitters_max; // union of m_emitters' bounds
+
+	bool m_occupancy_dirty; // density changed since the bricks were built
+
+	bool m_light_volume;
+	bool m_light_dirty;
+	glm::vec3 m_light_direction;
+	float m_light_absorption;
+
+	// brick lists: dispatch size (3 uints), count, packed bricks (brickListSource in GpuGrid3D.cpp)
+	GLuint m_allBricksBuffer;      // every brick, built once, what the dense mode runs on
+	GLuint m_activeBricksBuffer;   // sparse mode, rebuilt every step
+	GLuint m_clearedBricksBuffer;  // dropped out of the active list this step
+	GLuint m_brickContentBuffer;   // per brick flags, see brick_activity.comp
+	GLuint m_brickActiveBuffer;
+	int m_brick_count;
+	bool m_sparse_bricks;
+	float m_brick_threshold;
+
+	struct ClearTarget
+	{
+		GLuint texture;
+		Shader* shader;
+		GLenum format;
+	};
+
+	void updateActiveBricks();
+	// zeroes the bricks of the list in target.texture (clear.comp)
+	void clearBricks(const ClearTarget& target, GLuint brick_list);
+	// one group per brick of the list, indirect. the list is bound at ssbo binding 3
+	void dispatchBricks(GLuint brick_list);
+	GLuint stageBricks() const { return m_sparse_bricks ? m_activeBricksBuffer : m_allBricksBuffer; }
+
+	void reduceMaxVelocity();
+	void collectMaxVelocity();
+	void dropMaxVelocityReadbacks();
+
+	float pressureResidual();
+
+	void solvePressureJacobi(int max_iterations);
+	void solvePressureMultigrid();
+	void multigridVCycle(int level);
+	void multigridSmooth(const MultigridLevel& level, int sweeps);
+	void setMultigridUniforms(Shader& shader, const MultigridLevel& level);
+
+	// one jacobi_tiled.comp dispatch: iterations (<= tile iterations) of x = (b + alpha * neighbor_sum) * r_beta
+	// from x_tex into out_tex. b_tex can't be out_tex, other groups still read its halo
+	void jacobiTiled(Shader& shader, GLuint x_tex, GLuint b_tex, GLuint out_tex, GLenum format,
+		int iterations, float alpha, float r_beta, bool zero_guess, GLuint brick_list);
+
+	// diffuse passes of step, one field or both at once
+	void diffuseVelocity(int iterations, float alpha, float r_beta);
+	void diffuseDensity(int iterations, float alpha, float r_beta);
+	void diffuseFused(int iterations);
+	void createVelocityScratch();
+
+	// tiled diffuse of field, b stays in field while the iterate goes back and forth
+	// between temp and scratch. the result is swapped into field
+	void diffuseTiled(Shader& shader, GLuint& field, GLuint& temp, GLuint& scratch, GLenum format,
+		int tile_iterations, float alpha, float r_beta, int iterations);
+
 	GLuint create3DTexture(int internal_format, int format);
+	GLuint create3DTexture(int internal_format, int format, int width, int height, int depth);
+
+	void dispatch(int width, int height, int depth);
 
 	void getWorkGroups(GLuint& groupsX, GLuint& groupsY, GLuint& groupsZ);
 };
\ No newline at end of file
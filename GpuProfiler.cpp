@@ -0,0 +1,248 @@
+#include "GpuProfiler.h"
+#include "Trace.h"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+
+GpuProfiler::GpuProfiler(int latency_frames, int history)
+	: m_enabled(false), m_in_frame(false), m_in_stage(false),
+	m_history(std::max(history, 1)), m_dropped_frames(0), m_frame(0)
+{
+	// latency + 1 slots: the one being recorded and the ones still in flight
+	m_frames.resize(std::max(latency_frames, 1) + 1);
+	for (FrameQueries& frame : m_frames)
+	{
+		frame.used = 0;
+		frame.pending = false;
+	}
+
+	m_total.name = "total";
+	m_total.label = "total";
+	m_total.next = 0;
+	m_total.count = 0;
+	m_total.history.resize(m_history);
+}
+
+GpuProfiler::~GpuProfiler()
+{
+	for (FrameQueries& frame : m_frames)
+	{
+		if (!frame.queries.empty())
+			glDeleteQueries((GLsizei)frame.queries.size(), frame.queries.data());
+	}
+}
+
+void GpuProfiler::setEnabled(bool enabled)
+{
+	// don't leave a query open
+	if (m_in_stage)
+		endStage();
+	if (m_in_frame)
+		endFrame();
+
+	m_enabled = enabled;
+}
+
+void GpuProfiler::beginFrame()
+{
+	if (!m_enabled)
+		return;
+
+	// the slot we record into was used latency frames ago, read it back first
+	FrameQueries& frame = m_frames[m_frame % m_frames.size()];
+	if (frame.pending)
+		collect(frame);
+
+	frame.used = 0;
+	frame.stages.clear();
+	m_in_frame = true;
+}
+
+void GpuProfiler::endFrame()
+{
+	if (!m_enabled || !m_in_frame)
+		return;
+
+	if (m_in_stage)
+		endStage();
+
+	FrameQueries& frame = m_frames[m_frame % m_frames.size()];
+	frame.pending = frame.used > 0;
+	m_in_frame = false;
+	++m_frame;
+}
+
+void GpuProfiler::beginStage(const char* name)
+{
+	if (!m_enabled || !m_in_frame)
+		return;
+
+	if (m_in_stage)
+		endStage();
+
+	// a begin / end timestamp pair per stage
+	FrameQueries& frame = m_frames[m_frame % m_frames.size()];
+	if (2 * frame.used == (int)frame.queries.size())
+	{
+		GLuint queries[2] = { 0, 0 };
+		glGenQueries(2, queries);
+		frame.queries.push_back(queries[0]);
+		frame.queries.push_back(queries[1]);
+	}
+
+	frame.stages.push_back(findStage(name));
+	glQueryCounter(frame.queries[2 * frame.used], GL_TIMESTAMP);
+	m_in_stage = true;
+}
+
+void GpuProfiler::endStage()
+{
+	if (!m_enabled || !m_in_stage)
+		return;
+
+	FrameQueries& frame = m_frames[m_frame % m_frames.size()];
+	glQueryCounter(frame.queries[2 * frame.used + 1], GL_TIMESTAMP);
+	++frame.used;
+	m_in_stage = false;
+}
+
+int GpuProfiler::findStage(const char* name)
+{
+	for (size_t i = 0; i < m_stages.size(); ++i)
+	{
+		if (m_stages[i].name == name)
+			return (int)i;
+	}
+
+	Stage stage;
+	stage.name = name;
+	stage.label = name;
+	stage.history.resize(m_history);
+	stage.next = 0;
+	stage.count = 0;
+	m_stages.push_back(stage);
+	return (int)m_stages.size() - 1;
+}
+
+void GpuProfiler::collect(FrameQueries& frame)
+{
+	frame.pending = false;
+
+	// queries finish in order, if the last one is done they all are
+	GLint available = 0;
+	glGetQueryObjectiv(frame.queries[2 * frame.used - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available)
+	{
+		++m_dropped_frames;
+		return;
+	}
+
+	m_frame_ms.assign(m_stages.size(), -1.0f);
+	float total_ms = 0.0f;
+	for (int i = 0; i < frame.used; ++i)
+	{
+		GLuint64 begin_ns = 0, end_ns = 0;
+		glGetQueryObjectui64v(frame.queries[2 * i], GL_QUERY_RESULT, &begin_ns);
+		glGetQueryObjectui64v(frame.queries[2 * i + 1], GL_QUERY_RESULT, &end_ns);
+
+		float ms = (float)((double)(end_ns - begin_ns) * 1e-6);
+		Tracer::instance().recordGpu(m_stages[frame.stages[i]].label, begin_ns, end_ns);
+		float& stage_ms = m_frame_ms[frame.stages[i]];
+		stage_ms = std::max(stage_ms, 0.0f) + ms;
+		total_ms += ms;
+	}
+
+	for (size_t i = 0; i < m_stages.size(); ++i)
+	{
+		if (m_frame_ms[i] >= 0.0f)
+			addSample(m_stages[i], m_frame_ms[i]);
+	}
+	addSample(m_total, total_ms);
+}
+
+void GpuProfiler::addSample(Stage& stage, float ms)
+{
+	stage.history[stage.next] = ms;
+	stage.next = (stage.next + 1) % m_history;
+	stage.count = std::min(stage.count + 1, m_history);
+}
+
+GpuProfiler::StageStats GpuProfiler::stageStats(const Stage& stage) const
+{
+	StageStats stats = { stage.name, stage.count, 0.0f, 0.0f, 0.0f, 0.0f };
+	if (stage.count == 0)
+		return stats;
+
+	// the ring is full once count == history, else the samples are at the front
+	std::vector<float> samples(stage.history.begin(), stage.history.begin() + stage.count);
+
+	stats.last_ms = stage.history[(stage.next + m_history - 1) % m_history];
+	stats.min_ms = *std::min_element(samples.begin(), samples.end());
+
+	double sum = 0.0;
+	for (float ms : samples)
+		sum += ms;
+	stats.avg_ms = (float)(sum / samples.size());
+
+	// nearest rank
+	size_t rank = (size_t)std::ceil(0.99 * samples.size()) - 1;
+	std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+	stats.p99_ms = samples[rank];
+	return stats;
+}
+
+std::vector<GpuProfiler::StageStats> GpuProfiler::getStats() const
+{
+	std::vector<StageStats> stats;
+	for (const Stage& stage : m_stages)
+		stats.push_back(stageStats(stage));
+	stats.push_back(stageStats(m_total));
+	return stats;
+}
+
+void GpuProfiler::reset()
+{
+	for (Stage& stage : m_stages)
+	{
+		stage.next = 0;
+		stage.count = 0;
+	}
+	m_total.next = 0;
+	m_total.count = 0;
+	m_dropped_frames = 0;
+}
+
+void GpuProfiler::printStats(std::ostream& out) const
+{
+	std::ios_base::fmtflags flags = out.flags();
+	std::streamsize precision = out.precision();
+
+	out << std::setw(12) << "stage" << std::setw(9) << "samples" << std::setw(10) << "last ms"
+		<< std::setw(10) << "min ms" << std::setw(10) << "avg ms" << std::setw(10) << "p99 ms" << std::endl;
+
+	for (const StageStats& s : getStats())
+	{
+		out << std::setw(12) << s.name << std::setw(9) << s.samples << std::fixed << std::setprecision(3)
+			<< std::setw(10) << s.last_ms << std::setw(10) << s.min_ms
+			<< std::setw(10) << s.avg_ms << std::setw(10) << s.p99_ms << std::endl;
+	}
+	if (m_dropped_frames > 0)
+		out << m_dropped_frames << " frames dropped (results not ready in time)" << std::endl;
+
+	out.flags(flags);
+	out.precision(precision);
+}
+
+const char* GpuProfiler::csvHeader()
+{
+	return "frame,stage,samples,last_ms,min_ms,avg_ms,p99_ms";
+}
+
+void GpuProfiler::writeCsv(std::ostream& out, long long frame) const
+{
+	for (const StageStats& s : getStats())
+	{
+		out << frame << "," << s.name << "," << s.samples << "," << s.last_ms << ","
+			<< s.min_ms << "," << s.avg_ms << "," << s.p99_ms << "\n";
+	}
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <glad/glad.h>
+#include <string>
+#include <vector>
+#include <ostream>
+
+// gpu time of named stages of a frame, from a GL_TIMESTAMP query at the start and end
+// of each (same as GL_TIME_ELAPSED, which mesa's llvmpipe reports as 0 for compute).
+// results are read back latency frames later and only once they are available, so it
+// never stalls the pipeline (a frame whose queries still aren't done by then is dropped).
+// keeps the last history samples per stage for min / avg / p99.
+// stages run back to back, beginning one ends the last. a stage timed twice in a frame adds up.
+// stage names must be string literals. read back stages also go to the Tracer (Trace.h) when it's on
+class GpuProfiler
+{
+public:
+	struct StageStats
+	{
+		std::string name;
+		int samples;
+		float last_ms;
+		float min_ms;
+		float avg_ms;
+		float p99_ms;
+	};
+
+	GpuProfiler(int latency_frames = 4, int history = 256);
+	~GpuProfiler();
+
+	GpuProfiler(const GpuProfiler&) = delete;
+	GpuProfiler& operator=(const GpuProfiler&) = delete;
+
+	// off by default, everything below is a no-op then
+	void setEnabled(bool enabled);
+	bool isEnabled() const { return m_enabled; }
+
+	void beginFrame();
+	void endFrame();
+
+	void beginStage(const char* name);
+	void endStage();
+
+	// per stage in first-timed order, plus "total" (sum of the stages per frame)
+	std::vector<StageStats> getStats() const;
+
+	// frames whose results weren't ready after latency frames
+	int getDroppedFrames() const { return m_dropped_frames; }
+
+	void reset();
+
+	// table with one line per stage
+	void printStats(std::ostream& out) const;
+
+	// csv, one row per stage: frame,stage,samples,last_ms,min_ms,avg_ms,p99_ms
+	static const char* csvHeader();
+	void writeCsv(std::ostream& out, long long frame) const;
+
+private:
+	struct Stage
+	{
+		std::string name;
+		const char* label;          // what beginStage got, for the tracer
+		std::vector<float> history; // ring of ms
+		int next;
+		int count;
+	};
+
+	// one frame in flight
+	struct FrameQueries
+	{
+		std::vector<GLuint> queries; // begin / end pairs, grows to the stages per frame, reused
+		std::vector<int> stages;     // stage of each used pair
+		int used;                    // pairs
+		bool pending;
+	};
+
+	int findStage(const char* name);
+	void collect(FrameQueries& frame);
+	void addSample(Stage& stage, float ms);
+	StageStats stageStats(const Stage& stage) const;
+
+	bool m_enabled;
+	bool m_in_frame;
+	bool m_in_stage;
+	int m_history;
+	int m_dropped_frames;
+	long long m_frame;
+
+	std::vector<Stage> m_stages;
+	Stage m_total;
+	std::vector<FrameQueries> m_frames;
+	std::vector<float> m_frame_ms; // per stage sums while collecting
+};
@@ -0,0 +1,41 @@
+#pragma once
+#include <vector>
+
+// CPU grids are stored with a one cell halo: (width + 2) * (height + 2) values,
+// interior cell (x, y) lives at (x + 1) + (y + 1) * (width + 2).
+// stencils index neighbours directly (+-1, +-stride) and the halo is refreshed
+// here before each pass instead of clamping every access
+
+inline int haloIndex(int x, int y, int width)
+{
+	return (x + 1) + (y + 1) * (width + 2);
+}
+
+// 3d volumes use the same one cell halo on every side:
+// (width + 2) * (height + 2) * (depth + 2) values
+inline int haloIndex3D(int x, int y, int z, int width, int height)
+{
+	return (x + 1) + (y + 1) * (width + 2) + (z + 1) * (width + 2) * (height + 2);
+}
+
+// ghost cells copy their nearest interior cell (zero gradient edges)
+// works on any contiguous container (std::vector, FloatPlane)
+template <typename Field>
+void fillHalo(Field& field, int width, int height)
+{
+	int stride = width + 2;
+
+	// left and right columns
+	for (int y = 1; y <= height; ++y)
+	{
+		field[y * stride] = field[y * stride + 1];
+		field[y * stride + width + 1] = field[y * stride + width];
+	}
+
+	// bottom and top rows, corners come along from the columns above
+	for (int x = 0; x < stride; ++x)
+	{
+		field[x] = field[x + stride];
+		field[x + (height + 1) * stride] = field[x + height * stride];
+	}
+}
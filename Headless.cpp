@@ -0,0 +1,302 @@
+#include "Headless.h"
+#include <glad/glad.h>
+#include "GpuGrid3D.h"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__linux__)
+#define HEADLESS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#else
+#include <glfw3.h>
+#endif
+
+// GL 4.3 core context with nothing to draw to
+struct HeadlessContext
+{
+#ifdef HEADLESS_EGL
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLContext context = EGL_NO_CONTEXT;
+	EGLSurface surface = EGL_NO_SURFACE;
+#else
+	GLFWwindow* window = nullptr;
+#endif
+};
+
+static HeadlessContext g_context;
+
+#ifdef HEADLESS_EGL
+
+static bool createContext(HeadlessContext& ctx)
+{
+	// mesa's surfaceless platform needs no display server or gpu,
+	// fall back to the default display (e.g. a vendor driver)
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay)
+		ctx.display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	if (ctx.display == EGL_NO_DISPLAY)
+		ctx.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	EGLint major = 0, minor = 0;
+	if (ctx.display == EGL_NO_DISPLAY || !eglInitialize(ctx.display, &major, &minor))
+	{
+		std::cerr << "headless: no EGL display" << std::endl;
+		return false;
+	}
+
+	if (!eglBindAPI(EGL_OPENGL_API))
+	{
+		std::cerr << "headless: EGL has no desktop GL" << std::endl;
+		return false;
+	}
+
+	// a config is only needed for the pbuffer fallback
+	const EGLint config_attribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+	EGLConfig config = nullptr;
+	EGLint config_count = 0;
+	eglChooseConfig(ctx.display, config_attribs, &config, 1, &config_count);
+
+	const EGLint context_attribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	ctx.context = eglCreateContext(ctx.display, config_count > 0 ? config : nullptr, EGL_NO_CONTEXT, context_attribs);
+	if (ctx.context == EGL_NO_CONTEXT)
+	{
+		std::cerr << "headless: failed to create a GL 4.3 core context (EGL error 0x"
+			<< std::hex << eglGetError() << std::dec << ")" << std::endl;
+		return false;
+	}
+
+	// surfaceless (EGL_KHR_surfaceless_context), else a 1x1 pbuffer
+	if (!eglMakeCurrent(ctx.display, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx.context))
+	{
+		const EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+		if (config_count > 0)
+			ctx.surface = eglCreatePbufferSurface(ctx.display, config, pbuffer_attribs);
+
+		if (ctx.surface == EGL_NO_SURFACE || !eglMakeCurrent(ctx.display, ctx.surface, ctx.surface, ctx.context))
+		{
+			std::cerr << "headless: eglMakeCurrent failed" << std::endl;
+			return false;
+		}
+	}
+
+	if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress))
+	{
+		std::cerr << "failed to initialize GLAD" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+static void destroyContext(HeadlessContext& ctx)
+{
+	if (ctx.display == EGL_NO_DISPLAY)
+		return;
+
+	eglMakeCurrent(ctx.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (ctx.surface != EGL_NO_SURFACE)
+		eglDestroySurface(ctx.display, ctx.surface);
+	if (ctx.context != EGL_NO_CONTEXT)
+		eglDestroyContext(ctx.display, ctx.context);
+	eglTerminate(ctx.display);
+}
+
+#else
+
+static bool createContext(HeadlessContext& ctx)
+{
+	// no EGL here, a window that is never shown does the job
+	if (!glfwInit())
+	{
+		std::cerr << "failed to initialize GLFW" << std::endl;
+		return false;
+	}
+
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+	ctx.window = glfwCreateWindow(1, 1, "fluild sim (headless)", nullptr, nullptr);
+	if (!ctx.window)
+	{
+		std::cerr << "failed to create GLFW window" << std::endl;
+		return false;
+	}
+	glfwMakeContextCurrent(ctx.window);
+
+	if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+	{
+		std::cerr << "failed to initialize GLAD" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+static void destroyContext(HeadlessContext& ctx)
+{
+	if (ctx.window)
+		glfwDestroyWindow(ctx.window);
+	glfwTerminate();
+}
+
+#endif
+
+static std::vector<float> readTexture(GLuint texture, GLenum format, int components, int cell_count)
+{
+	std::vector<float> values((size_t)cell_count * components);
+	glBindTexture(GL_TEXTURE_3D, texture);
+	glGetTexImage(GL_TEXTURE_3D, 0, format, GL_FLOAT, values.data());
+	glBindTexture(GL_TEXTURE_3D, 0);
+	return values;
+}
+
+static void printFieldStats(GpuGrid3D& grid)
+{
+	int cell_count = grid.m_width * grid.m_height * grid.m_depth;
+
+	std::vector<float> density = readTexture(grid.getDensityTexture(), GL_RED, 1, cell_count);
+	std::vector<float> velocity = readTexture(grid.getVelocityTexture(), GL_RGBA, 4, cell_count);
+	std::vector<float> pressure = readTexture(grid.m_pressureTexA, GL_RED, 1, cell_count);
+
+	double density_sum = 0.0;
+	float density_max = 0.0f;
+	double speed_sum = 0.0;
+	float speed_max = 0.0f;
+	double pressure_sum = 0.0;
+	bool finite = true;
+
+	for (int i = 0; i < cell_count; ++i)
+	{
+		float d = density[i];
+		float speed = std::sqrt(velocity[4 * i] * velocity[4 * i] +
+			velocity[4 * i + 1] * velocity[4 * i + 1] +
+			velocity[4 * i + 2] * velocity[4 * i + 2]);
+
+		finite = finite && std::isfinite(d) && std::isfinite(speed) && std::isfinite(pressure[i]);
+		density_sum += d;
+		density_max = std::max(density_max, d);
+		speed_sum += speed;
+		speed_max = std::max(speed_max, speed);
+		pressure_sum += std::fabs(pressure[i]);
+	}
+
+	std::cout << std::setprecision(6) << std::defaultfloat
+		<< "density   sum " << density_sum << "  max " << density_max << std::endl
+		<< "speed     mean " << speed_sum / cell_count << "  max " << speed_max
+		<< "  (gpu reduction, a few steps old: " << grid.getMaxVelocity() << ")" << std::endl
+		<< "|p|       mean " << pressure_sum / cell_count << std::endl
+		<< "pressure  " << grid.getLastPressureIterations()
+		<< (grid.getPressureSolver() == GpuGrid3D::PressureSolver::Multigrid ? " V-cycles" : " iterations")
+		<< " last step";
+	if (grid.getLastPressureResidual() >= 0.0f)
+		std::cout << ", residual " << grid.getLastPressureResidual();
+	std::cout << std::endl;
+
+	if (!finite)
+		std::cout << "fields contain NaN / inf" << std::endl;
+}
+
+bool createHeadlessContext()
+{
+	if (createContext(g_context))
+		return true;
+
+	destroyContext(g_context);
+	g_context = HeadlessContext();
+	return false;
+}
+
+void destroyHeadlessContext()
+{
+	destroyContext(g_context);
+	g_context = HeadlessContext();
+}
+
+int runHeadless(int frames, int grid_size, bool sparse_bricks)
+{
+	if (!createHeadlessContext())
+		return -1;
+
+	std::cout << "headless: " << glGetString(GL_RENDERER) << " | " << glGetString(GL_VERSION) << std::endl;
+
+	int result = 0;
+	{
+		// same setup as the interactive app
+		GpuGrid3D grid(grid_size, grid_size, grid_size, GL_RGBA16F);
+		grid.clear();
+		grid.setPressureSolver(GpuGrid3D::PressureSolver::Multigrid);
+		grid.setMultigridCycles(2);
+		grid.getProfiler().setEnabled(true);
+		grid.setMaxVelocityReduction(true);
+		grid.setSparseBricks(sparse_bricks);
+
+		const float dt = 1.0f / 60.0f;
+		const float target_cfl = 1.0f;
+		const int max_cfl_substeps = 4;
+		const float viscosity = .000001f;
+		const int diffuse_iterations = 4;
+		const int pressure_iterations = 4;
+
+		// brush: circle of radius 1/4 around the centre in the z = 1/2 plane, one turn per
+		// 120 frames, splatting 3 frames out of 4. velocity like main (model delta * 5)
+		glm::vec3 last_brush(0.0f);
+		glFinish();
+		auto start = std::chrono::high_resolution_clock::now();
+
+		for (int frame = 0; frame < frames; ++frame)
+		{
+			float angle = 6.2831853f * (float)frame / 120.0f;
+			glm::vec3 brush_model(0.25f * std::cos(angle), 0.25f * std::sin(angle), 0.0f);
+			glm::vec3 brush_vel = frame > 0 ? (brush_model - last_brush) * 5.0f : glm::vec3(0.0f);
+			last_brush = brush_model;
+
+			glm::vec3 brush_grid = (brush_model + 0.5f) * glm::vec3((float)grid_size, (float)grid_size, (float)grid_size);
+			bool splatting = (frame % 4) != 3;
+
+			int cfl_substeps = grid.cflSubsteps(dt, target_cfl, max_cfl_substeps);
+			for (int j = 0; j < cfl_substeps; ++j)
+			{
+				grid.step(brush_grid, brush_vel, j == 0 && splatting, dt / cfl_substeps,
+					viscosity, diffuse_iterations, pressure_iterations);
+			}
+		}
+
+		glFinish();
+		auto end = std::chrono::high_resolution_clock::now();
+		double ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+		std::cout << "GpuGrid3D " << grid_size << "^3, " << frames << " steps: "
+			<< std::fixed << std::setprecision(2) << ms << " ms total, "
+			<< (frames > 0 ? ms / frames : 0.0) << " ms/step" << std::endl;
+
+		printFieldStats(grid);
+		if (sparse_bricks)
+			std::cout << "active bricks: " << grid.getActiveBrickCount() << " / " << grid.getBrickCount() << std::endl;
+		std::cout << std::endl;
+		grid.getProfiler().printStats(std::cout);
+
+		if (glGetError() != GL_NO_ERROR)
+		{
+			std::cerr << "headless: GL error" << std::endl;
+			result = -1;
+		}
+	}
+
+	destroyHeadlessContext();
+	return result;
+}
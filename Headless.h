@@ -0,0 +1,13 @@
+#pragma once
+
+// runs GpuGrid3D::step for a number of frames without a window, with the app's solver
+// settings, a fixed dt and a scripted brush (a circle through the middle of the grid).
+// prints the step time, density / velocity / pressure stats and per stage gpu times at the end.
+// linux: EGL surfaceless context (mesa llvmpipe is enough), elsewhere a hidden GLFW window.
+// sparse_bricks runs the grid in its sparse mode (GpuGrid3D::setSparseBricks)
+int runHeadless(int frames, int grid_size, bool sparse_bricks = false);
+
+// just the context part of the above, for other gpu batch runs (the sweep benchmark).
+// makes a GL 4.3 core context current and loads glad, false if there is none
+bool createHeadlessContext();
+void destroyHeadlessContext();
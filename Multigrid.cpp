@@ -0,0 +1,259 @@
+#include "Multigrid.h"
+#include "GridHalo.h"
+#include <cmath>
+
+Multigrid::Multigrid(int width, int height)
+	: m_last_residual(0.0f), m_last_stalled(false), m_kernels(getScalarFluidKernels()),
+	m_pre_smooth(2), m_post_smooth(2), m_coarse_smooth(32)
+{
+	// halve until the coarsest level is a few cells wide
+	int w = width;
+	int h = height;
+	while (true)
+	{
+		Level level;
+		level.width = w;
+		level.height = h;
+		// same halo layout as FluidGrid
+		int size = (w + 2) * (h + 2);
+		level.p.resize(size, 0.0f);
+		level.rhs.resize(size, 0.0f);
+		level.residual.resize(size, 0.0f);
+		m_levels.push_back(std::move(level));
+
+		if (w <= 4 || h <= 4)
+			break;
+
+		w = (w + 1) / 2;
+		h = (h + 1) / 2;
+	}
+
+	m_row_sums.resize(height, 0.0);
+}
+
+void Multigrid::smooth(Level& level, int iterations, ThreadPool& pool)
+{
+	int w = level.width;
+	int h = level.height;
+	int stride = w + 2;
+	FloatPlane& p = level.p;
+	const FloatPlane& b = level.rhs;
+
+	// red-black Gauss-Seidel, same ordering as FluidGrid::linearSolve
+	for (int k = 0; k < iterations; ++k)
+	{
+		for (int color = 0; color < 2; ++color)
+		{
+			fillHalo(p, w, h);
+
+			pool.parallelFor(0, h, [&](int row_begin, int row_end)
+			{
+				for (int y = row_begin; y < row_end; ++y)
+				{
+					int index = haloIndex(0, y, w);
+					m_kernels->relaxRow(&p[index], &b[index], stride, w, (y + color) & 1, 1.0f, 4.0f);
+				}
+			});
+		}
+	}
+}
+
+void Multigrid::computeResidual(Level& level, ThreadPool& pool)
+{
+	int w = level.width;
+	int h = level.height;
+	int stride = w + 2;
+	FloatPlane& p = level.p;
+
+	fillHalo(p, w, h);
+
+	pool.parallelFor(0, h, [&](int row_begin, int row_end)
+	{
+		for (int y = row_begin; y < row_end; ++y)
+		{
+			for (int x = 0; x < w; ++x)
+			{
+				int index = haloIndex(x, y, w);
+				float neighbor_sum =
+					p[index - 1] +
+					p[index + 1] +
+					p[index - stride] +
+					p[index + stride];
+				level.residual[index] = level.rhs[index] - (4.0f * p[index] - neighbor_sum);
+			}
+		}
+	});
+}
+
+void Multigrid::restrictResidual(const Level& fine, Level& coarse, ThreadPool& pool)
+{
+	// cell centred: each coarse cell covers 2x2 fine cells. the stencil is unscaled
+	// (h^2 folded in), so the coarse rhs is (2h)^2/h^2 * average = sum of the children.
+	// on odd edges a coarse cell only has 1-2 children, summing them (instead of
+	// averaging) keeps the total, which the pure neumann problem needs to stay solvable
+	pool.parallelFor(0, coarse.height, [&](int row_begin, int row_end)
+	{
+		for (int cy = row_begin; cy < row_end; ++cy)
+		{
+			for (int cx = 0; cx < coarse.width; ++cx)
+			{
+				float sum = 0.0f;
+				for (int dy = 0; dy < 2; ++dy)
+				{
+					for (int dx = 0; dx < 2; ++dx)
+					{
+						int fx = 2 * cx + dx;
+						int fy = 2 * cy + dy;
+						if (fx < fine.width && fy < fine.height)
+							sum += fine.residual[haloIndex(fx, fy, fine.width)];
+					}
+				}
+
+				int index = haloIndex(cx, cy, coarse.width);
+				coarse.rhs[index] = sum;
+				coarse.p[index] = 0.0f; // error starts at zero
+			}
+		}
+	});
+}
+
+void Multigrid::prolongate(Level& coarse, Level& fine, ThreadPool& pool)
+{
+	int coarse_stride = coarse.width + 2;
+	float max_cx = (float)(coarse.width - 1);
+	float max_cy = (float)(coarse.height - 1);
+
+	fillHalo(coarse.p, coarse.width, coarse.height);
+
+	// bilinear, fine cell centre x maps to coarse coord x/2 - 1/4
+	pool.parallelFor(0, fine.height, [&](int row_begin, int row_end)
+	{
+		for (int y = row_begin; y < row_end; ++y)
+		{
+			float cy = y * 0.5f - 0.25f;
+			cy = cy < 0.0f ? 0.0f : (cy > max_cy ? max_cy : cy);
+			int y0 = (int)cy;
+			float sy = cy - (float)y0;
+
+			for (int x = 0; x < fine.width; ++x)
+			{
+				float cx = x * 0.5f - 0.25f;
+				cx = cx < 0.0f ? 0.0f : (cx > max_cx ? max_cx : cx);
+				int x0 = (int)cx;
+				float sx = cx - (float)x0;
+
+				int index = haloIndex(x0, y0, coarse.width);
+				float v00 = coarse.p[index];
+				float v10 = coarse.p[index + 1];
+				float v01 = coarse.p[index + coarse_stride];
+				float v11 = coarse.p[index + coarse_stride + 1];
+
+				float top = v00 + sx * (v10 - v00);
+				float bottom = v01 + sx * (v11 - v01);
+
+				fine.p[haloIndex(x, y, fine.width)] += top + sy * (bottom - top);
+			}
+		}
+	});
+}
+
+double Multigrid::norm(const Level& level, const FloatPlane& values, ThreadPool& pool)
+{
+	// per row partial sums added up in row order, so the result does not depend on the thread split
+	pool.parallelFor(0, level.height, [&](int row_begin, int row_end)
+	{
+		for (int y = row_begin; y < row_end; ++y)
+		{
+			double sum = 0.0;
+			for (int x = 0; x < level.width; ++x)
+			{
+				double v = values[haloIndex(x, y, level.width)];
+				sum += v * v;
+			}
+			m_row_sums[y] = sum;
+		}
+	});
+
+	double total = 0.0;
+	for (int y = 0; y < level.height; ++y)
+		total += m_row_sums[y];
+
+	return std::sqrt(total);
+}
+
+void Multigrid::vCycle(int level_index, ThreadPool& pool)
+{
+	Level& level = m_levels[level_index];
+
+	// coarsest, just smooth it out
+	if (level_index == (int)m_levels.size() - 1)
+	{
+		// pure neumann problem, keep the rhs compatible (zero sum)
+		float mean = 0.0f;
+		for (int y = 0; y < level.height; ++y)
+			for (int x = 0; x < level.width; ++x)
+				mean += level.rhs[haloIndex(x, y, level.width)];
+		mean /= (float)(level.width * level.height);
+		for (int y = 0; y < level.height; ++y)
+			for (int x = 0; x < level.width; ++x)
+				level.rhs[haloIndex(x, y, level.width)] -= mean;
+
+		smooth(level, m_coarse_smooth, pool);
+		return;
+	}
+
+	smooth(level, m_pre_smooth, pool);
+
+	computeResidual(level, pool);
+	restrictResidual(level, m_levels[level_index + 1], pool);
+
+	vCycle(level_index + 1, pool);
+
+	prolongate(m_levels[level_index + 1], level, pool);
+	smooth(level, m_post_smooth, pool);
+}
+
+int Multigrid::solve(FloatPlane& pressure, const FloatPlane& rhs, ThreadPool& pool,
+	float tolerance, int max_cycles)
+{
+	Level& finest = m_levels[0];
+	std::swap(finest.p, pressure);
+	finest.rhs = rhs;
+
+	double rhs_norm = norm(finest, finest.rhs, pool);
+	int cycles = 0;
+	m_last_stalled = false;
+
+	if (rhs_norm > 0.0)
+	{
+		computeResidual(finest, pool);
+		double residual = norm(finest, finest.residual, pool) / rhs_norm;
+
+		while (residual > tolerance && cycles < max_cycles)
+		{
+			vCycle(0, pool);
+			++cycles;
+
+			computeResidual(finest, pool);
+			double previous = residual;
+			residual = norm(finest, finest.residual, pool) / rhs_norm;
+
+			// stalled at float precision, more cycles won't help. reported, so it doesn't
+			// pass for convergence
+			if (residual > tolerance && residual > 0.5 * previous)
+			{
+				m_last_stalled = true;
+				break;
+			}
+		}
+		m_last_residual = (float)residual;
+	}
+	else
+	{
+		// nothing to solve
+		m_last_residual = 0.0f;
+	}
+
+	std::swap(finest.p, pressure);
+	return cycles;
+}
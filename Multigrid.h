@@ -0,0 +1,59 @@
+#pragma once
+#include <vector>
+#include "ThreadPool.h"
+#include "AlignedAllocator.h"
+#include "FluidKernels.h"
+
+// geometric multigrid for the FluidGrid pressure equation, on halo padded grids (GridHalo.h)
+// 4 * p - (p_left + p_right + p_bottom + p_top) = rhs
+// with clamped (zero gradient) edges, same stencil as the Gauss-Seidel path
+class Multigrid
+{
+public:
+	Multigrid(int width, int height);
+
+	// V-cycles until ||residual|| <= tolerance * ||rhs|| or max_cycles is hit,
+	// pressure is used as the initial guess. returns cycles taken. also stops early when a
+	// cycle no longer halves the residual (float precision), see getLastStalled
+	int solve(FloatPlane& pressure, const FloatPlane& rhs, ThreadPool& pool,
+		float tolerance, int max_cycles);
+
+	// row kernels the smoother runs on, scalar until told otherwise
+	void setKernels(const FluidKernels* kernels) { m_kernels = kernels; }
+
+	// relative residual after the last solve
+	float getLastResidual() const { return m_last_residual; }
+
+	// the last solve stopped on a stall, not on the tolerance or max_cycles.
+	// the residual is left as it was, above the tolerance
+	bool getLastStalled() const { return m_last_stalled; }
+
+	int getLevelCount() const { return (int)m_levels.size(); }
+
+private:
+	struct Level
+	{
+		int width;
+		int height;
+		FloatPlane p;
+		FloatPlane rhs;
+		FloatPlane residual;
+	};
+
+	std::vector<Level> m_levels;
+	std::vector<double> m_row_sums;
+	float m_last_residual;
+	bool m_last_stalled;
+	const FluidKernels* m_kernels;
+
+	int m_pre_smooth;
+	int m_post_smooth;
+	int m_coarse_smooth;
+
+	void vCycle(int level, ThreadPool& pool);
+	void smooth(Level& level, int iterations, ThreadPool& pool);
+	void computeResidual(Level& level, ThreadPool& pool);
+	void restrictResidual(const Level& fine, Level& coarse, ThreadPool& pool);
+	void prolongate(Level& coarse, Level& fine, ThreadPool& pool);
+	double norm(const Level& level, const FloatPlane& values, ThreadPool& pool);
+};
@@ -0,0 +1,192 @@
+#include "RaymarchTarget.h"
+#include <glm/gtc/type_ptr.hpp>
+#include <algorithm>
+#include <cmath>
+
+// fullscreen quad for quad.vert
+static const float quad_vertices[] = {
+	// positions   // texCoords
+	-1.0f,  1.0f,  0.0f, 1.0f,
+	-1.0f, -1.0f,  0.0f, 0.0f,
+	 1.0f, -1.0f,  1.0f, 0.0f,
+	-1.0f,  1.0f,  0.0f, 1.0f,
+	 1.0f, -1.0f,  1.0f, 0.0f,
+	 1.0f,  1.0f,  1.0f, 1.0f
+};
+
+// frames averaged per scale update
+static const int k_adapt_frames = 15;
+
+RaymarchTarget::RaymarchTarget(int width, int height)
+	: m_width(width), m_height(height), m_scaled_width(width), m_scaled_height(height),
+	m_scale(1.0f), m_min_scale(.25f),
+	m_target_frame_ms(0.0f), m_frame_ms_sum(0.0), m_frame_count(0),
+	m_previousFramebuffer(0), m_previousViewport(), m_blend_was_enabled(false),
+	m_upsampleShader("quad.vert", "upsample.frag")
+{
+	glGenTextures(1, &m_colorTex);
+	glBindTexture(GL_TEXTURE_2D, m_colorTex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	glGenTextures(1, &m_depthTex);
+	glBindTexture(GL_TEXTURE_2D, m_depthTex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT, nullptr);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// color at location 0, entry distance at 1 (see raymarch.frag). no depth buffer, the
+	// raymarch pass draws back faces only, each pixel once
+	glGenFramebuffers(1, &m_framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_colorTex, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, m_depthTex, 0);
+	GLenum draw_buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+	glDrawBuffers(2, draw_buffers);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	glGenVertexArrays(1, &m_quadVAO);
+	glGenBuffers(1, &m_quadVBO);
+	glBindVertexArray(m_quadVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, m_quadVBO);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(quad_vertices), quad_vertices, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
+	glEnableVertexAttribArray(1);
+	glBindVertexArray(0);
+
+	glProgramUniform1i(m_upsampleShader.ID, m_upsampleShader.getUniformLocation("u_volume_color"), 0);
+	glProgramUniform1i(m_upsampleShader.ID, m_upsampleShader.getUniformLocation("u_volume_depth"), 1);
+}
+
+RaymarchTarget::~RaymarchTarget()
+{
+	GLuint textures[] = { m_colorTex, m_depthTex };
+	glDeleteTextures(2, textures);
+	glDeleteFramebuffers(1, &m_framebuffer);
+	glDeleteVertexArrays(1, &m_quadVAO);
+	glDeleteBuffers(1, &m_quadVBO);
+	glDeleteProgram(m_upsampleShader.ID);
+}
+
+void RaymarchTarget::setScale(float scale)
+{
+	m_scale = std::min(std::max(scale, m_min_scale), 1.0f);
+	m_scaled_width = std::max((int)std::lround(m_width * m_scale), 1);
+	m_scaled_height = std::max((int)std::lround(m_height * m_scale), 1);
+}
+
+void RaymarchTarget::adapt(double frame_seconds)
+{
+	if (m_target_frame_ms <= 0.0f)
+		return;
+
+	m_frame_ms_sum += frame_seconds * 1000.0;
+	if (++m_frame_count < k_adapt_frames)
+		return;
+
+	double frame_ms = m_frame_ms_sum / m_frame_count;
+	m_frame_ms_sum = 0.0;
+	m_frame_count = 0;
+
+	// only act outside [.85, 1.05] x target, so a frame that just makes it doesn't bounce
+	if (frame_ms <= m_target_frame_ms * 1.05 && frame_ms >= m_target_frame_ms * .85)
+		return;
+
+	// raymarch cost goes with the pixel count, scale^2. at most 10% per update, the sim
+	// and the swap are in the frame time too
+	float ratio = (float)std::sqrt(m_target_frame_ms / frame_ms);
+	setScale(m_scale * std::min(std::max(ratio, .9f), 1.1f));
+}
+
+void RaymarchTarget::begin()
+{
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &m_previousFramebuffer);
+	glGetIntegerv(GL_VIEWPORT, m_previousViewport);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+	glViewport(0, 0, m_scaled_width, m_scaled_height);
+
+	// raw raymarch output, blending happens in the upsample
+	m_blend_was_enabled = glIsEnabled(GL_BLEND) == GL_TRUE;
+	glDisable(GL_BLEND);
+
+	// clears ignore the viewport, scissor them to the part in use
+	GLfloat no_color[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	GLfloat no_entry[] = { -1.0f, 0.0f, 0.0f, 0.0f };
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(0, 0, m_scaled_width, m_scaled_height);
+	glClearBufferfv(GL_COLOR, 0, no_color);
+	glClearBufferfv(GL_COLOR, 1, no_entry);
+	glDisable(GL_SCISSOR_TEST);
+}
+
+void RaymarchTarget::upsample(const glm::mat4& view_projection, const glm::mat4& model, const glm::vec3& camera_pos)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, m_previousFramebuffer);
+	glViewport(m_previousViewport[0], m_previousViewport[1], m_previousViewport[2], m_previousViewport[3]);
+	if (m_blend_was_enabled)
+		glEnable(GL_BLEND);
+
+	glm::mat4 view_projection_inv = glm::inverse(view_projection);
+	glm::mat4 model_inv = glm::inverse(model);
+
+	m_upsampleShader.use();
+	glUniform2i(m_upsampleShader.getUniformLocation("u_scaled_size"), m_scaled_width, m_scaled_height);
+	glUniform2f(m_upsampleShader.getUniformLocation("u_screen_size"), (float)m_previousViewport[2], (float)m_previousViewport[3]);
+	glUniformMatrix4fv(m_upsampleShader.getUniformLocation("u_view_projection"), 1, GL_FALSE, glm::value_ptr(view_projection));
+	glUniformMatrix4fv(m_upsampleShader.getUniformLocation("u_view_projection_inv"), 1, GL_FALSE, glm::value_ptr(view_projection_inv));
+	glUniformMatrix4fv(m_upsampleShader.getUniformLocation("u_model"), 1, GL_FALSE, glm::value_ptr(model));
+	glUniformMatrix4fv(m_upsampleShader.getUniformLocation("u_model_inv"), 1, GL_FALSE, glm::value_ptr(model_inv));
+	glUniform3fv(m_upsampleShader.getUniformLocation("u_camera_pos"), 1, glm::value_ptr(camera_pos));
+
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, m_depthTex);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, m_colorTex);
+
+	// only the cube's part of the screen needs the upsample, scissor the quad to it
+	glm::ivec4 rect;
+	bool scissor = screenRect(view_projection * model, rect);
+	if (scissor)
+	{
+		glEnable(GL_SCISSOR_TEST);
+		glScissor(rect.x, rect.y, rect.z, rect.w);
+	}
+
+	glBindVertexArray(m_quadVAO);
+	glDrawArrays(GL_TRIANGLES, 0, 6);
+	glBindVertexArray(0);
+
+	if (scissor)
+		glDisable(GL_SCISSOR_TEST);
+}
+
+bool RaymarchTarget::screenRect(const glm::mat4& model_view_projection, glm::ivec4& rect) const
+{
+	// ndc bounds of the 8 corners. a corner behind the camera and the box can cover
+	// anything, use the whole viewport then
+	glm::vec2 low(1.0f), high(-1.0f);
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		glm::vec4 position(corner & 1 ? .5f : -.5f, corner & 2 ? .5f : -.5f, corner & 4 ? .5f : -.5f, 1.0f);
+		glm::vec4 clip = model_view_projection * position;
+		if (clip.w <= 0.0f)
+			return false;
+
+		glm::vec2 ndc(clip.x / clip.w, clip.y / clip.w);
+		low = glm::vec2(std::min(low.x, ndc.x), std::min(low.y, ndc.y));
+		high = glm::vec2(std::max(high.x, ndc.x), std::max(high.y, ndc.y));
+	}
+
+	// to pixels, one extra around for the rounding
+	int x0 = (int)std::floor((std::max(low.x, -1.0f) * .5f + .5f) * m_previousViewport[2]) - 1;
+	int y0 = (int)std::floor((std::max(low.y, -1.0f) * .5f + .5f) * m_previousViewport[3]) - 1;
+	int x1 = (int)std::ceil((std::min(high.x, 1.0f) * .5f + .5f) * m_previousViewport[2]) + 1;
+	int y1 = (int)std::ceil((std::min(high.y, 1.0f) * .5f + .5f) * m_previousViewport[3]) + 1;
+	rect = glm::ivec4(m_previousViewport[0] + x0, m_previousViewport[1] + y0, std::max(x1 - x0, 0), std::max(y1 - y0, 0));
+	return true;
+}
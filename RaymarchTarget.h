@@ -0,0 +1,70 @@
+#pragma once
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "shader.h"
+
+// offscreen target for the raymarch pass at a fraction of the window resolution, upsampled
+// onto the bound framebuffer with a depth aware (joint bilateral) filter.
+// the raymarcher writes its color and the ray's box entry distance (location 1). upsample.frag
+// recomputes the entry distance per full res pixel and weights the 4 low res texels around it
+// by how close theirs is, so nothing bleeds across the cube's silhouette.
+// textures are allocated at full size once, a scale change only changes the viewport.
+// with a target frame time set, adapt() moves the scale to hit it
+class RaymarchTarget
+{
+public:
+	RaymarchTarget(int width, int height);
+	~RaymarchTarget();
+
+	RaymarchTarget(const RaymarchTarget&) = delete;
+	RaymarchTarget& operator=(const RaymarchTarget&) = delete;
+
+	// linear scale per axis, clamped to [min scale, 1]. 1 is full res
+	void setScale(float scale);
+	float getScale() const { return m_scale; }
+
+	// 0 keeps the scale fixed
+	void setTargetFrameTime(float frame_ms) { m_target_frame_ms = frame_ms; }
+	void setMinScale(float min_scale) { m_min_scale = min_scale; }
+
+	// full res when the scale is 1, the raymarch can go straight to the framebuffer then
+	bool isFullRes() const { return m_scale >= 1.0f; }
+
+	// once per frame with the frame's time. averages over a few frames, then scales the
+	// pixel count by target / measured (damped), with some slack so it doesn't flicker
+	void adapt(double frame_seconds);
+
+	// binds the target at the scaled viewport, cleared (color 0, entry distance -1)
+	void begin();
+
+	// upsamples onto the framebuffer that was bound before begin(), blended as the raymarch
+	// pass would be, and writes the depth of the cube's back faces like the raymarch pass does.
+	// camera and model have to match the ones the raymarch used
+	void upsample(const glm::mat4& view_projection, const glm::mat4& model, const glm::vec3& camera_pos);
+
+	int getWidth() const { return m_scaled_width; }
+	int getHeight() const { return m_scaled_height; }
+
+private:
+	// pixels the unit cube covers in the viewport upsample() draws to, false if it can't tell
+	bool screenRect(const glm::mat4& model_view_projection, glm::ivec4& rect) const;
+
+	int m_width, m_height;
+	int m_scaled_width, m_scaled_height;
+	float m_scale;
+	float m_min_scale;
+
+	float m_target_frame_ms;
+	double m_frame_ms_sum;
+	int m_frame_count;
+
+	GLuint m_framebuffer;
+	GLuint m_colorTex;  // RGBA16F, what raymarch.frag returns
+	GLuint m_depthTex;  // R32F, box entry distance, -1 where the ray misses
+	GLint m_previousFramebuffer;
+	GLint m_previousViewport[4];
+	bool m_blend_was_enabled;
+
+	GLuint m_quadVAO, m_quadVBO;
+	Shader m_upsampleShader;
+};
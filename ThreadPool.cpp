@@ -0,0 +1,93 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int thread_count)
+	: m_thread_count(thread_count < 1 ? 1 : thread_count),
+	m_body(nullptr), m_begin(0), m_end(0),
+	m_generation(0), m_pending(0), m_stop(false)
+{
+	// caller is worker 0, spawn the rest
+	for (int i = 1; i < m_thread_count; ++i)
+	{
+		m_workers.emplace_back(&ThreadPool::workerLoop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_start_cv.notify_all();
+
+	for (std::thread& worker : m_workers)
+	{
+		worker.join();
+	}
+}
+
+void ThreadPool::runChunk(int chunk_index)
+{
+	int count = m_end - m_begin;
+	int chunk_begin = m_begin + (int)((long long)count * chunk_index / m_thread_count);
+	int chunk_end = m_begin + (int)((long long)count * (chunk_index + 1) / m_thread_count);
+
+	if (chunk_begin < chunk_end)
+		(*m_body)(chunk_begin, chunk_end);
+}
+
+void ThreadPool::parallelFor(int begin, int end, const std::function<void(int, int)>& body)
+{
+	if (end <= begin)
+		return;
+
+	// nothing to share
+	if (m_thread_count == 1 || end - begin == 1)
+	{
+		body(begin, end);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_body = &body;
+		m_begin = begin;
+		m_end = end;
+		m_pending = m_thread_count - 1;
+		++m_generation;
+	}
+	m_start_cv.notify_all();
+
+	runChunk(0);
+
+	// wait for the others
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_done_cv.wait(lock, [this] { return m_pending == 0; });
+	m_body = nullptr;
+}
+
+void ThreadPool::workerLoop(int worker_index)
+{
+	int seen_generation = 0;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_start_cv.wait(lock, [&] { return m_stop || m_generation != seen_generation; });
+
+			if (m_stop)
+				return;
+
+			seen_generation = m_generation;
+		}
+
+		runChunk(worker_index);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			--m_pending;
+		}
+		m_done_cv.notify_one();
+	}
+}
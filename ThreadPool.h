@@ -0,0 +1,38 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+class ThreadPool
+{
+public:
+	ThreadPool(int thread_count);
+	~ThreadPool();
+
+	int getThreadCount() const { return m_thread_count; }
+
+	// split [begin, end) into one contiguous chunk per thread, run body(chunk_begin, chunk_end)
+	// on each and block until all chunks are done. the caller thread runs chunk 0
+	void parallelFor(int begin, int end, const std::function<void(int, int)>& body);
+
+private:
+	int m_thread_count;
+	std::vector<std::thread> m_workers;
+
+	std::mutex m_mutex;
+	std::condition_variable m_start_cv;
+	std::condition_variable m_done_cv;
+
+	// current job
+	const std::function<void(int, int)>* m_body;
+	int m_begin;
+	int m_end;
+	int m_generation;
+	int m_pending;
+	bool m_stop;
+
+	void workerLoop(int worker_index);
+	void runChunk(int chunk_index);
+};
@@ -0,0 +1,131 @@
+#include "Trace.h"
+#include <glad/glad.h>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+#include <set>
+#include <string>
+#include <cstdio>
+
+static int64_t steadyNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Tracer& Tracer::instance()
+{
+	static Tracer tracer;
+	return tracer;
+}
+
+Tracer::Tracer()
+	: m_enabled(false), m_next(0), m_epoch_ns(steadyNs()), m_gpu_offset_ns(0)
+{
+}
+
+void Tracer::setEnabled(bool enabled)
+{
+	// ring allocated on first use, before anyone can record into it
+	if (enabled && m_events.empty())
+		m_events.resize(k_capacity);
+
+	m_enabled.store(enabled, std::memory_order_release);
+}
+
+int64_t Tracer::now() const
+{
+	return steadyNs() - m_epoch_ns;
+}
+
+int Tracer::threadIndex()
+{
+	// small ids in order of the first event, 0 is whoever records first (the main loop)
+	static std::atomic<int> next_thread(0);
+	thread_local int thread = next_thread.fetch_add(1, std::memory_order_relaxed);
+	return thread;
+}
+
+void Tracer::record(const char* name, int64_t begin_ns, int64_t end_ns, int thread)
+{
+	if (!isEnabled())
+		return;
+
+	uint64_t slot = m_next.fetch_add(1, std::memory_order_relaxed) & (k_capacity - 1);
+	Event& event = m_events[slot];
+	event.name = name;
+	event.begin_ns = begin_ns;
+	event.end_ns = end_ns;
+	event.thread = thread;
+}
+
+void Tracer::recordCpu(const char* name, int64_t begin_ns, int64_t end_ns)
+{
+	record(name, begin_ns, end_ns, threadIndex());
+}
+
+void Tracer::calibrateGpuClock()
+{
+	// GL_TIMESTAMP read back now vs the cpu clock around the call
+	int64_t before = now();
+	GLint64 gpu_ns = 0;
+	glGetInteger64v(GL_TIMESTAMP, &gpu_ns);
+	int64_t after = now();
+
+	m_gpu_offset_ns = (before + after) / 2 - (int64_t)gpu_ns;
+}
+
+void Tracer::recordGpu(const char* name, uint64_t gpu_begin_ns, uint64_t gpu_end_ns)
+{
+	record(name, (int64_t)gpu_begin_ns + m_gpu_offset_ns, (int64_t)gpu_end_ns + m_gpu_offset_ns, -1);
+}
+
+void Tracer::clear()
+{
+	m_next.store(0, std::memory_order_relaxed);
+}
+
+bool Tracer::writeJson(const char* path) const
+{
+	std::ofstream file(path);
+	if (!file)
+		return false;
+
+	uint64_t next = m_next.load(std::memory_order_acquire);
+	uint64_t count = std::min(next, k_capacity);
+	uint64_t first = next - count;
+
+	// gpu on its own track (tid 0), cpu threads from 1
+	file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+	file << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"gpu\"}}";
+
+	std::set<int> threads;
+	char buffer[256];
+	for (uint64_t i = first; i < next; ++i)
+	{
+		const Event& event = m_events[i & (k_capacity - 1)];
+		if (!event.name)
+			continue;
+
+		int tid = event.thread + 1;
+		threads.insert(tid);
+
+		// microseconds
+		snprintf(buffer, sizeof(buffer),
+			",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d}",
+			event.name, tid == 0 ? "gpu" : "cpu",
+			event.begin_ns * 1e-3, std::max<int64_t>(event.end_ns - event.begin_ns, 0) * 1e-3, tid);
+		file << buffer;
+	}
+
+	for (int tid : threads)
+	{
+		if (tid == 0)
+			continue;
+		file << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << tid
+			<< ", \"args\": {\"name\": \"" << (tid == 1 ? std::string("main") : "thread " + std::to_string(tid - 1)) << "\"}}";
+	}
+
+	file << "\n]}\n";
+	return (bool)file;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// timeline of cpu zones and gpu stages, written as chrome trace-event json
+// (chrome://tracing, ui.perfetto.dev).
+// cpu zones: TRACE_SCOPE("name") times the rest of the block on the calling thread.
+// gpu: GpuProfiler hands its stage timestamps over when it reads them back, on a "gpu" track.
+// events go into a fixed ring (the newest 64k are kept), a slot is claimed with one atomic
+// add so any thread can record. disabled, a scope costs one relaxed load and nothing is allocated
+class Tracer
+{
+public:
+	static Tracer& instance();
+
+	void setEnabled(bool enabled);
+	bool isEnabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+	// ns since the tracer was created
+	int64_t now() const;
+
+	// name must outlive the tracer (string literals)
+	void recordCpu(const char* name, int64_t begin_ns, int64_t end_ns);
+
+	// gpu times are GL_TIMESTAMP values, mapped to the cpu clock with the offset from
+	// calibrateGpuClock (needs a current GL context)
+	void calibrateGpuClock();
+	void recordGpu(const char* name, uint64_t gpu_begin_ns, uint64_t gpu_end_ns);
+
+	// writes what's in the ring. threads still recording while this runs can show up
+	// half written, call it between frames
+	bool writeJson(const char* path) const;
+
+	void clear();
+
+private:
+	Tracer();
+
+	struct Event
+	{
+		const char* name;
+		int64_t begin_ns;
+		int64_t end_ns;
+		int thread; // -1 for the gpu
+	};
+
+	void record(const char* name, int64_t begin_ns, int64_t end_ns, int thread);
+	static int threadIndex();
+
+	static const uint64_t k_capacity = 1 << 16;
+
+	std::atomic<bool> m_enabled;
+	std::atomic<uint64_t> m_next;
+	std::vector<Event> m_events;
+	int64_t m_epoch_ns;
+	int64_t m_gpu_offset_ns; // cpu ns - gpu ns
+};
+
+// times its scope on the calling thread while the tracer is enabled
+class TraceScope
+{
+public:
+	explicit TraceScope(const char* name)
+		: m_name(name), m_begin_ns(Tracer::instance().isEnabled() ? Tracer::instance().now() : -1) {}
+
+	~TraceScope() { end(); }
+
+	// closes the zone before the end of the block (locals that outlive it)
+	void end()
+	{
+		if (m_begin_ns >= 0)
+			Tracer::instance().recordCpu(m_name, m_begin_ns, Tracer::instance().now());
+		m_begin_ns = -1;
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	const char* m_name;
+	int64_t m_begin_ns;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
@@ -3,19 +3,30 @@
 #include <glfw3.h>
 #include "shader.h"
 #include "GpuGrid3D.h"
+#include "Benchmark.h"
+#include "BenchmarkSweep.h"
+#include "Trace.h"
+#include "Headless.h"
+#include "RaymarchTarget.h"
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <vector>
 #include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <fstream>
 
+// counter clockwise seen from outside, the raymarch pass culls front faces
 float cube_vertices[] = {
 	-0.5f, -0.5f, -0.5f,
-	 0.5f, -0.5f, -0.5f,
 	 0.5f,  0.5f, -0.5f,
+	 0.5f, -0.5f, -0.5f,
 	 0.5f,  0.5f, -0.5f,
-	-0.5f,  0.5f, -0.5f,
 	-0.5f, -0.5f, -0.5f,
+	-0.5f,  0.5f, -0.5f,
 
 	-0.5f, -0.5f,  0.5f,
 	 0.5f, -0.5f,  0.5f,
@@ -32,11 +43,11 @@ float cube_vertices[] = {
 	-0.5f,  0.5f,  0.5f,
 
 	 0.5f,  0.5f,  0.5f,
-	 0.5f,  0.5f, -0.5f,
 	 0.5f, -0.5f, -0.5f,
+	 0.5f,  0.5f, -0.5f,
 	 0.5f, -0.5f, -0.5f,
-	 0.5f, -0.5f,  0.5f,
 	 0.5f,  0.5f,  0.5f,
+	 0.5f, -0.5f,  0.5f,
 
 	-0.5f, -0.5f, -0.5f,
 	 0.5f, -0.5f, -0.5f,
@@ -46,11 +57,11 @@ float cube_vertices[] = {
 	-0.5f, -0.5f, -0.5f,
 
 	-0.5f,  0.5f, -0.5f,
-	 0.5f,  0.5f, -0.5f,
 	 0.5f,  0.5f,  0.5f,
+	 0.5f,  0.5f, -0.5f,
 	 0.5f,  0.5f,  0.5f,
-	-0.5f,  0.5f,  0.5f,
-	-0.5f,  0.5f, -0.5f
+	-0.5f,  0.5f, -0.5f,
+	-0.5f,  0.5f,  0.5f
 };
 
 //float quad_vertices[] = {
@@ -82,10 +93,87 @@ bool rayPlaneIntersect(
 }
 
 int g_DebugMode = 0; // 0: density, 1: velocity, 2: pressure
+bool g_WriteTrace = false; // T key, dump the trace now
+bool g_Lighting = true; // L key, self shadowing from the light volume
+bool g_Emitters = false; // E key, the fixed sources along the floor
 //int g_current_slice = 64;  // start from mid
 
-int main()
+int main(int argc, char** argv)
 {
+	// per stage gpu timings, printed (or appended to a csv) every profile_interval seconds
+	bool profile = false;
+	double profile_interval = 2.0;
+	const char* profile_csv_path = nullptr;
+
+	// cpu / gpu timeline for chrome://tracing or perfetto, written on T and on exit
+	const char* trace_path = nullptr;
+
+	// raymarch resolution: --render-scale s fixes it, else it adapts to --target-frame-ms
+	float render_scale = 1.0f;
+	float target_frame_ms = 1000.0f / 60.0f;
+
+	// --sparse: sim stages only on the bricks with smoke or motion (GpuGrid3D::setSparseBricks)
+	bool sparse_bricks = false;
+
+	// cpu benchmarks and headless runs, no window needed
+	for (int i = 1; i < argc; ++i)
+	{
+		// --profile [seconds], --profile-csv file
+		if (std::strcmp(argv[i], "--profile") == 0)
+		{
+			profile = true;
+			if (i + 1 < argc && std::atof(argv[i + 1]) > 0.0)
+				profile_interval = std::atof(argv[++i]);
+			continue;
+		}
+		if (std::strcmp(argv[i], "--profile-csv") == 0 && i + 1 < argc)
+		{
+			profile = true;
+			profile_csv_path = argv[++i];
+			continue;
+		}
+		if (std::strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+		{
+			trace_path = argv[++i];
+			continue;
+		}
+		if (std::strcmp(argv[i], "--render-scale") == 0 && i + 1 < argc)
+		{
+			render_scale = (float)std::atof(argv[++i]);
+			target_frame_ms = 0.0f;
+			continue;
+		}
+		if (std::strcmp(argv[i], "--target-frame-ms") == 0 && i + 1 < argc)
+		{
+			target_frame_ms = (float)std::atof(argv[++i]);
+			continue;
+		}
+		if (std::strcmp(argv[i], "--sparse") == 0)
+		{
+			sparse_bricks = true;
+			continue;
+		}
+
+		if (std::strcmp(argv[i], "--bench-threads") == 0)
+			return runThreadScalingBenchmark();
+		if (std::strcmp(argv[i], "--bench-kernels") == 0)
+			return runKernelBenchmark();
+		if (std::strcmp(argv[i], "--bench-grid3d") == 0)
+			return runGrid3DBenchmark();
+		if (std::strcmp(argv[i], "--bench-tiles") == 0)
+			return runActiveTilesBenchmark();
+		if (std::strcmp(argv[i], "--bench-sweep") == 0)
+			return runSweepBenchmark(argc - i - 1, argv + i + 1);
+
+		// gpu sim without a window: --headless [frames] [grid size]
+		if (std::strcmp(argv[i], "--headless") == 0)
+		{
+			int frames = i + 1 < argc ? std::atoi(argv[i + 1]) : 0;
+			int grid_size = i + 2 < argc ? std::atoi(argv[i + 2]) : 0;
+			return runHeadless(frames > 0 ? frames : 300, grid_size > 0 ? grid_size : 64, sparse_bricks);
+		}
+	}
+
 	// glfw init
 	if (!glfwInit())
 	{
@@ -126,7 +214,8 @@ int main()
 	glEnable(GL_DEPTH_TEST); // depth test
 	glEnable(GL_BLEND); // transparency blending
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); // default alpha blending
-	glDisable(GL_CULL_FACE); // disable cull
+	glDisable(GL_CULL_FACE); // disable cull, the raymarch pass turns it on for itself
+	glCullFace(GL_FRONT);
 
 	/* 3D */
 	// setup cube vao vbo
@@ -146,35 +235,83 @@ int main()
 
 	// load shaders
 	Shader raymarchShader("raymarch.vert", "raymarch.frag");
-	Shader clearShader("clear.comp");
-	Shader splatShader("splat.comp");
 	Shader wireframeShader("wireframe.vert", "wireframe.frag");
-	Shader advectShader("advect.comp");
-	Shader diffuseShader("diffuse.comp");
-	Shader divergenceShader("divergence.comp");
-	Shader pressureShader("pressure.comp");
-	Shader gradientShader("gradient.comp");
+
+	// volume at a fraction of the window resolution, bilateral upsampled (full res at scale 1)
+	RaymarchTarget raymarchTarget(SCREEN_WIDTH, SCREEN_HEIGHT);
+	raymarchTarget.setScale(render_scale);
+	raymarchTarget.setTargetFrameTime(target_frame_ms);
 
 	// create 3d grid
 	const int GRID_WIDTH = 64;
 	const int GRID_HEIGHT = 64;
 	const int GRID_DEPTH = 64;
-	GpuGrid3D gpuGrid(GRID_WIDTH, GRID_HEIGHT, GRID_DEPTH);
+	// sim compute shaders are built by the grid, per texture format
+	GpuGrid3D gpuGrid(GRID_WIDTH, GRID_HEIGHT, GRID_DEPTH, GL_RGBA16F);
 
 	// clear grid
-	gpuGrid.clear(clearShader);
+	gpuGrid.clear();
+
+	// a few jacobi iterations barely touch the low frequency divergence, V-cycles do
+	gpuGrid.setPressureSolver(GpuGrid3D::PressureSolver::Multigrid);
+	gpuGrid.setMultigridCycles(2);
+
+	// cfl: each fixed step is split so the fastest cell moves at most target_cfl cells per
+	// substep. max |v| comes from a gpu reduction read back a few steps late, never waited on
+	gpuGrid.setMaxVelocityReduction(true);
+	gpuGrid.setSparseBricks(sparse_bricks);
+	// transmittance toward the light at half res, sampled once per raymarch step
+	gpuGrid.setLightVolume(true, 2);
+	const glm::vec3 light_dir = glm::normalize(glm::vec3(.5f, 1.0f, .3f)); // world space, toward the light
+
+	// E key: three sources on the floor pushing up, splatted with the brush in one dispatch
+	std::vector<Emitter> floor_emitters;
+	for (int i = 0; i < 3; ++i)
+	{
+		Emitter emitter;
+		emitter.shape = i == 1 ? EmitterShape::Box : EmitterShape::Sphere;
+		emitter.position = glm::vec3(GRID_WIDTH * (.25f + .25f * i), GRID_HEIGHT * .1f, GRID_DEPTH * .5f);
+		emitter.size = glm::vec3(GRID_WIDTH * .05f);
+		emitter.rate = 20.0f;
+		emitter.force = glm::vec3(0.0f, 60.0f, 0.0f);
+		floor_emitters.push_back(emitter);
+	}
+	const float target_cfl = 1.0f;
+	const int max_cfl_substeps = 4;
+
+	gpuGrid.getProfiler().setEnabled(profile || trace_path);
+	if (trace_path)
+	{
+		Tracer::instance().setEnabled(true);
+		Tracer::instance().calibrateGpuClock();
+	}
+	std::ofstream profile_csv;
+	if (profile_csv_path)
+	{
+		profile_csv.open(profile_csv_path);
+		profile_csv << GpuProfiler::csvHeader() << "\n";
+	}
 
 	
 	glm::vec3 camera_pos = glm::vec3(.0, .0, 3.0); // cam pos const
 	glm::vec2 total_rotation = glm::vec2(.0f); // mouse rotation
 	glm::vec2 last_mouse_pos_cam = glm::vec2(.0f);
 	float rotation_speed = .1f;
-	float dt = .016f;  // delta time
+	const float raymarch_samples_per_cell = 1.5f; // ~.01 steps at 64^3, what it used to march
+	// fixed sim step: frame time goes into an accumulator and whole steps come out, at most
+	// max_substeps per rendered frame. a slow frame drops the rest instead of taking a huge dt,
+	// a fast one renders the last state without stepping
+	const float dt = 1.0f / 60.0f;
+	const int max_substeps = 4;
+	double sim_accumulator = 0.0;
 
 	float viscosity = .000001f;
 	int diffuse_iterations = 4;
 
-	int pressure_iterations = 4;
+	int pressure_iterations = 4; // jacobi only, the multigrid solver runs its V-cycles
+	double last_stats_time = glfwGetTime();
+	double last_profile_time = last_stats_time;
+	long long frame_index = 0;
 
 
 	////////
@@ -202,6 +339,20 @@ int main()
 				std::cout << "dispMode pressure" << std::endl;
 				g_DebugMode = 2;
 			}
+			else if (key == GLFW_KEY_T)
+			{
+				g_WriteTrace = true;
+			}
+			else if (key == GLFW_KEY_L)
+			{
+				g_Lighting = !g_Lighting;
+				std::cout << "lighting " << (g_Lighting ? "on" : "off") << std::endl;
+			}
+			else if (key == GLFW_KEY_E)
+			{
+				g_Emitters = !g_Emitters;
+				std::cout << "emitters " << (g_Emitters ? "on" : "off") << std::endl;
+			}
 			//else if (key == GLFW_KEY_W)
 			//{
 			//	g_current_slice = glm::min(GRID_DEPTH - 1, g_current_slice + 1);
@@ -263,14 +414,27 @@ int main()
 	// main loop
 	while (!glfwWindowShouldClose(window))
 	{
+		TRACE_SCOPE("frame");
+
 		// time
 		double current_time = glfwGetTime();
-		dt = (float)(current_time - last_frame_time);
+		double frame_dt = current_time - last_frame_time;
 		last_frame_time = current_time;
-		//dt = .016f;
+		raymarchTarget.adapt(frame_dt);
+
+		sim_accumulator += frame_dt;
+		int substeps = std::min((int)(sim_accumulator / dt), max_substeps);
+		sim_accumulator -= substeps * (double)dt;
+		if (substeps == max_substeps)
+			sim_accumulator = std::fmod(sim_accumulator, (double)dt); // behind, drop the backlog
 
 		// INPUT
-		glfwPollEvents();
+		{
+			TRACE_SCOPE("poll events");
+			glfwPollEvents();
+		}
+
+		TraceScope matrices_zone("matrices");
 
 		// proj mat (field of view)
 		glm::mat4 projection = glm::perspective(glm::radians(45.0f),
@@ -300,6 +464,7 @@ int main()
 
 		// inv
 		glm::mat4 model_inv = glm::inverse(model);
+		matrices_zone.end();
 
 		// cam rotation
 		if (mouse.right_pressed)
@@ -344,10 +509,12 @@ int main()
 			mouseIsIntersecting = true;
 			mousePos3D_world = intersectionPoint;
 
+			// brush velocity per sim step: mouse speed * dt, so it doesn't depend on the frame rate
+			// (same as the old per frame delta * 5 at 60 fps)
 			glm::vec3 mouse_vel3D_world = glm::vec3(0.0);
-			if (lastMousePos != glm::vec3(0.0f))
+			if (lastMousePos != glm::vec3(0.0f) && frame_dt > 0.0)
 			{
-				mouse_vel3D_world = (mousePos3D_world - lastMousePos) * 5.0f;
+				mouse_vel3D_world = (mousePos3D_world - lastMousePos) / (float)frame_dt * dt * 5.0f;
 			}
 			lastMousePos = mousePos3D_world;
 
@@ -364,56 +531,141 @@ int main()
 			lastMousePos = glm::vec3(0.0f);
 		}
 
+		if (gpuGrid.getEmitters().empty() == g_Emitters)
+			gpuGrid.setEmitters(g_Emitters ? floor_emitters : std::vector<Emitter>());
+
 		/////////////////////////////////////////////////////
 		// step
-		gpuGrid.step(splatShader, advectShader, diffuseShader,
-			divergenceShader, pressureShader, gradientShader,
-			mousePos3D_grid, mouse_vel3D_model,
-			mouse.left_pressed && mouseIsIntersecting,
-			dt,
-			viscosity, diffuse_iterations, pressure_iterations);
+		TraceScope step_zone("sim step");
+		for (int i = 0; i < substeps; ++i)
+		{
+			// the brush splats once per fixed step, not once per cfl substep
+			int cfl_substeps = gpuGrid.cflSubsteps(dt, target_cfl, max_cfl_substeps);
+			for (int j = 0; j < cfl_substeps; ++j)
+			{
+				gpuGrid.step(mousePos3D_grid, mouse_vel3D_model,
+					j == 0 && mouse.left_pressed && mouseIsIntersecting,
+					dt / cfl_substeps,
+					viscosity, diffuse_iterations, pressure_iterations);
+			}
+		}
+		++frame_index;
+		step_zone.end();
 		/////////////////////////////////////////////////////
 
+		if (profile && current_time - last_profile_time > profile_interval)
+		{
+			last_profile_time = current_time;
+			if (profile_csv.is_open())
+			{
+				gpuGrid.getProfiler().writeCsv(profile_csv, frame_index);
+				profile_csv.flush();
+			}
+			else
+			{
+				std::cout << "gpu stages, frame " << frame_index << std::endl;
+				gpuGrid.getProfiler().printStats(std::cout);
+			}
+		}
+
+		// solver stats in the title, once a second
+		if (current_time - last_stats_time > 1.0)
+		{
+			last_stats_time = current_time;
+			bool multigrid = gpuGrid.getPressureSolver() == GpuGrid3D::PressureSolver::Multigrid;
+			std::string title = std::string("fluild sim | pressure ") + (multigrid ? "V-cycles: " : "iters: ")
+				+ std::to_string(gpuGrid.getLastPressureIterations());
+			if (gpuGrid.getLastPressureResidual() >= 0.0f)
+				title += " residual: " + std::to_string(gpuGrid.getLastPressureResidual());
+			if (gpuGrid.getMaxVelocity() >= 0.0f)
+				title += " | max |v|: " + std::to_string(gpuGrid.getMaxVelocity())
+					+ " substeps: " + std::to_string(gpuGrid.cflSubsteps(dt, target_cfl, max_cfl_substeps));
+			title += " | render scale: " + std::to_string(raymarchTarget.getScale());
+			if (gpuGrid.getSparseBricks())
+				title += " | bricks: " + std::to_string(gpuGrid.getActiveBrickCount()) + "/" + std::to_string(gpuGrid.getBrickCount());
+			glfwSetWindowTitle(window, title.c_str());
+		}
+
+		if (g_WriteTrace && trace_path)
+		{
+			g_WriteTrace = false;
+			std::cout << (Tracer::instance().writeJson(trace_path) ? "trace written to " : "failed to write ") << trace_path << std::endl;
+		}
+
 		// render
+		TraceScope render_zone("render");
+		gpuGrid.updateOccupancy(); // empty space skipping bricks, once for however many steps ran
+		// the light stays put in world space while the cube turns, so it moves in model space
+		if (gpuGrid.getLightVolume() != g_Lighting)
+			gpuGrid.setLightVolume(g_Lighting);
+		gpuGrid.setLightDirection(glm::vec3(model_inv * glm::vec4(light_dir, 0.0f)));
+		gpuGrid.updateLightVolume();
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 		glViewport(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
 
 		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		// pass raymarch
+		// pass raymarch, back faces only: each covered pixel is shaded once, entry / exit are
+		// found in the shader (camera inside the cube still has the back faces)
+		glEnable(GL_CULL_FACE);
+		bool low_res = !raymarchTarget.isFullRes();
+		if (low_res)
+			raymarchTarget.begin();
 		raymarchShader.use();
 
-		glUniformMatrix4fv(glGetUniformLocation(raymarchShader.ID, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
-		glUniformMatrix4fv(glGetUniformLocation(raymarchShader.ID, "view"), 1, GL_FALSE, glm::value_ptr(view));
-		glUniformMatrix4fv(glGetUniformLocation(raymarchShader.ID, "model"), 1, GL_FALSE, glm::value_ptr(model));
-		glUniformMatrix4fv(glGetUniformLocation(raymarchShader.ID, "u_model_inv"), 1, GL_FALSE, glm::value_ptr(model_inv));
-		glUniform3fv(glGetUniformLocation(raymarchShader.ID, "u_camera_pos"), 1, glm::value_ptr(camera_pos));
-		glUniform1i(glGetUniformLocation(raymarchShader.ID, "u_volume_texture"), 0);
+		glUniformMatrix4fv(raymarchShader.getUniformLocation("projection"), 1, GL_FALSE, glm::value_ptr(projection));
+		glUniformMatrix4fv(raymarchShader.getUniformLocation("view"), 1, GL_FALSE, glm::value_ptr(view));
+		glUniformMatrix4fv(raymarchShader.getUniformLocation("model"), 1, GL_FALSE, glm::value_ptr(model));
+		glUniformMatrix4fv(raymarchShader.getUniformLocation("u_model_inv"), 1, GL_FALSE, glm::value_ptr(model_inv));
+		glUniform3fv(raymarchShader.getUniformLocation("u_camera_pos"), 1, glm::value_ptr(camera_pos));
+		glUniform1i(raymarchShader.getUniformLocation("u_volume_texture"), 0);
+		glUniform3f(raymarchShader.getUniformLocation("u_grid_size"), (float)GRID_WIDTH, (float)GRID_HEIGHT, (float)GRID_DEPTH);
+		glUniform1f(raymarchShader.getUniformLocation("u_samples_per_cell"), raymarch_samples_per_cell);
+		glUniform1i(raymarchShader.getUniformLocation("u_occupancy_texture"), 1);
+		glm::ivec3 bricks = gpuGrid.getOccupancySize();
+		glUniform3f(raymarchShader.getUniformLocation("u_occupancy_size"), (float)bricks.x, (float)bricks.y, (float)bricks.z);
+		glUniform1i(raymarchShader.getUniformLocation("u_light_texture"), 2);
+		glUniform1i(raymarchShader.getUniformLocation("u_lighting"), g_Lighting);
 
 		glActiveTexture(GL_TEXTURE0);
 		glBindTexture(GL_TEXTURE_3D, gpuGrid.getDensityTexture());
 
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_3D, gpuGrid.getOccupancyTexture());
+		glActiveTexture(GL_TEXTURE2);
+		glBindTexture(GL_TEXTURE_3D, gpuGrid.getLightTexture());
+		glActiveTexture(GL_TEXTURE0);
+
 		glBindVertexArray(cubeVAO);
 		glDrawArrays(GL_TRIANGLES, 0, 36);
+		glDisable(GL_CULL_FACE);
+
+		if (low_res)
+			raymarchTarget.upsample(projection * view, model, camera_pos);
 
 		// --- Pass 2: Wireframe ---
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 		wireframeShader.use();
 
 		// --- NO REDEFINITION ---
-		glUniformMatrix4fv(glGetUniformLocation(wireframeShader.ID, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
-		glUniformMatrix4fv(glGetUniformLocation(wireframeShader.ID, "view"), 1, GL_FALSE, glm::value_ptr(view));
-		glUniformMatrix4fv(glGetUniformLocation(wireframeShader.ID, "model"), 1, GL_FALSE, glm::value_ptr(model));
+		glUniformMatrix4fv(wireframeShader.getUniformLocation("projection"), 1, GL_FALSE, glm::value_ptr(projection));
+		glUniformMatrix4fv(wireframeShader.getUniformLocation("view"), 1, GL_FALSE, glm::value_ptr(view));
+		glUniformMatrix4fv(wireframeShader.getUniformLocation("model"), 1, GL_FALSE, glm::value_ptr(model));
 
 		glBindVertexArray(cubeVAO);
 		glDrawArrays(GL_TRIANGLES, 0, 36);
 
 		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+		render_zone.end();
 
+		TRACE_SCOPE("swap buffers");
 		glfwSwapBuffers(window);
 	}
 
+	if (trace_path)
+		std::cout << (Tracer::instance().writeJson(trace_path) ? "trace written to " : "failed to write ") << trace_path << std::endl;
+
 	// clean
 	glDeleteVertexArrays(1, &cubeVAO);
 	glDeleteBuffers(1, &cubeVBO);
@@ -1,59 +1,128 @@
 #version 430 core
-out vec4 FragColor;
+layout (location = 0) out vec4 FragColor;
+layout (location = 1) out float EntryDistance; // for RaymarchTarget's upsample, ignored otherwise
 
 in vec3 v_worldPos;
-in vec3 v_texCoords;
+
+// drawn on the back faces only (front faces culled), one invocation per covered pixel.
+// entry / exit come from a ray-box test, so the march covers the whole volume and also
+// works with the camera inside the cube
 
 // uniforms
 uniform sampler3D u_volume_texture;
 uniform vec3 u_camera_pos;
 uniform mat4 u_model_inv;
 
+// step length is 1 / (samples_per_cell * max grid side) in texture space
+uniform vec3 u_grid_size;
+uniform float u_samples_per_cell;
+
+// max density per brick (GpuGrid3D::getOccupancyTexture), nearest. a brick at or below
+// k_min_density can't add anything, the steps inside it are skipped without sampling
+uniform sampler3D u_occupancy_texture;
+uniform vec3 u_occupancy_size; // bricks per axis, ceil(u_grid_size / k_brick_size)
+
+const float k_min_density = .01;
+const float k_brick_size = 8.0; // GpuGrid3D::k_brick_size
+
+// transmittance toward the light (GpuGrid3D::getLightTexture), one lookup per sample instead of
+// a march toward the light. lit samples get full brightness, shadowed ones go down to k_ambient
+uniform sampler3D u_light_texture;
+uniform bool u_lighting;
+
+const float k_ambient = .25;
+
+// alpha of one sample at the old fixed step of .01, corrected for the actual step length
+const float k_reference_alpha = .05;
+const float k_reference_step = .01;
+
+const int k_max_steps = 1024;
+
+// steps from t = 0 (ray_pos) to where the ray leaves the brick. brick b covers texels
+// [8b, 8b + 8), the last one on an axis is cut off by the grid when its side isn't a multiple of 8
+float stepsToBrickExit(vec3 ray_pos, vec3 ray_step, vec3 brick, vec3 grid_size)
+{
+    vec3 brick_min = brick * k_brick_size / grid_size;
+    vec3 brick_max = min((brick + 1.0) * k_brick_size / grid_size, 1.0);
+
+    // the face the ray heads to on each axis, a zero step component gives +inf
+    vec3 exit_face = mix(brick_min, brick_max, step(0.0, ray_step));
+    vec3 t = (exit_face - ray_pos) / ray_step;
+    return min(min(t.x, t.y), t.z);
+}
+
+// ray vs the [0, 1] box (slabs), x = entry, y = exit. dir components of 0 give +-inf
+// per slab, which min / max handle
+vec2 intersectBox(vec3 origin, vec3 dir)
+{
+    vec3 t0 = (vec3(0.0) - origin) / dir;
+    vec3 t1 = (vec3(1.0) - origin) / dir;
+    vec3 t_min = min(t0, t1);
+    vec3 t_max = max(t0, t1);
+    return vec2(max(max(t_min.x, t_min.y), t_min.z), min(min(t_max.x, t_max.y), t_max.z));
+}
+
 void main()
 {
-    // get ray dir from world space
-    vec3 ray_dir_world = normalize(v_worldPos - u_camera_pos);
+    // camera and ray in texture space (model space + .5)
+    vec3 ray_origin = (u_model_inv * vec4(u_camera_pos, 1.0)).xyz + 0.5;
+    vec3 ray_dir = normalize((u_model_inv * vec4(v_worldPos - u_camera_pos, 0.0)).xyz);
+
+    // camera inside the cube, start at the camera
+    vec2 t_box = intersectBox(ray_origin, ray_dir);
+    float t_entry = max(t_box.x, 0.0);
+    float t_exit = t_box.y;
+    if (t_exit <= t_entry)
+        discard;
+    EntryDistance = t_entry;
+
+    // RAY MARCHING, front to back
+    float step_length = 1.0 / (u_samples_per_cell * max(max(u_grid_size.x, u_grid_size.y), u_grid_size.z));
+    int num_steps = min(int(ceil((t_exit - t_entry) / step_length)), k_max_steps);
+
+    vec3 ray_start = ray_origin + ray_dir * t_entry;
+    vec3 ray_step = ray_dir * step_length;
+
+    float sample_alpha = 1.0 - pow(1.0 - k_reference_alpha, step_length / k_reference_step);
 
-    // transform ray from world to model
-    vec3 ray_dir_model = (u_model_inv * vec4(ray_dir_world, 0.0)).xyz;
-    
-    // RAY MARCHING
-    
-    // ray starts from back
-    vec3 ray_pos = v_texCoords; 
-    
-    // step towards to cam
-    vec3 ray_step = normalize(ray_dir_model) * .01;
-    
     vec4 accumulated_color = vec4(.0);
-    int num_steps = 64;
 
-    for (int i = 0; i < num_steps; i++)
+    // samples stay on the start + i * step lattice, skipping only leaves out ones that
+    // would have been below k_min_density, so the image is the same
+    int i = 0;
+    while (i < num_steps)
     {
+        vec3 ray_pos = clamp(ray_start + ray_step * float(i), 0.0, 1.0);
+
+        // empty brick, jump to the first step past it
+        vec3 brick = min(floor(ray_pos * u_grid_size / k_brick_size), u_occupancy_size - 1.0);
+        if (texelFetch(u_occupancy_texture, ivec3(brick), 0).r <= k_min_density)
+        {
+            i += max(int(stepsToBrickExit(ray_pos, ray_step, brick, u_grid_size)) + 1, 1);
+            continue;
+        }
+
         // sample density
         float density = texture(u_volume_texture, ray_pos).r;
-        //float display_density = density * .1;
 
-        if (density > .01)
+        if (density > k_min_density)
         {
-            float constant_alpha = .05;
-
+            // premultiplied, what's in front covers what's behind
             vec3 color = vec3(1.0, 1.0, 1.0) * density;
+            if (u_lighting)
+                color *= mix(k_ambient, 1.0, texture(u_light_texture, ray_pos).r);
 
-            accumulated_color.rgb = (color * constant_alpha) + (accumulated_color.rgb * (1.0 - constant_alpha));
-            accumulated_color.a = constant_alpha + (accumulated_color.a * (1.0 - constant_alpha));
+            float weight = (1.0 - accumulated_color.a) * sample_alpha;
+            accumulated_color.rgb += color * weight;
+            accumulated_color.a += weight;
         }
         
         // move ray
-        ray_pos += ray_step; // march forward
+        ++i; // march forward
         
-        // stop if exit or opaque
-        if (accumulated_color.a > 0.95 || 
-            any(lessThan(ray_pos, vec3(0.0))) || 
-            any(greaterThan(ray_pos, vec3(1.0))))
-        {
+        // stop if opaque
+        if (accumulated_color.a > 0.95)
             break;
-        }
     }
     
     FragColor = accumulated_color;
@@ -78,9 +78,16 @@ Shader::Shader(const char* vertexPath, const char* fragmentPath)
 	// delete shaders
 	glDeleteShader(vertex);
 	glDeleteShader(fragment);
+
+	cacheUniformLocations();
 }
 
 Shader::Shader(const char* computePath)
+	: Shader(computePath, std::string())
+{
+}
+
+Shader::Shader(const char* computePath, const std::string& defines)
 {
 	// get shader
 	std::string computeCode;
@@ -100,6 +107,19 @@ Shader::Shader(const char* computePath)
 		std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ: " << e.what() << std::endl;
 	}
 
+	// #version has to stay the first line
+	if (!defines.empty())
+	{
+		size_t insert_at = 0;
+		if (computeCode.compare(0, 8, "#version") == 0)
+		{
+			size_t line_end = computeCode.find('\n');
+			insert_at = line_end == std::string::npos ? computeCode.size() : line_end + 1;
+		}
+		// #line keeps compile errors on the file's own line numbers
+		computeCode.insert(insert_at, defines + "#line 2\n");
+	}
+
 	const char* cShaderCode = computeCode.c_str();
 
 	// compile
@@ -131,9 +151,45 @@ Shader::Shader(const char* computePath)
 	// delete
 	glDeleteShader(compute);
 
+	cacheUniformLocations();
 }
 
 void Shader::use()
 {
 	glUseProgram(ID);
-}
\ No newline at end of file
+}
+
+void Shader::cacheUniformLocations()
+{
+	int uniform_count = 0;
+	int max_name_length = 0;
+	glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &uniform_count);
+	glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_name_length);
+
+	std::string name(max_name_length > 0 ? max_name_length : 1, '\0');
+	for (int i = 0; i < uniform_count; ++i)
+	{
+		GLsizei length = 0;
+		GLint size = 0;
+		GLenum type = 0;
+		glGetActiveUniform(ID, (GLuint)i, (GLsizei)name.size(), &length, &size, &type, &name[0]);
+
+		std::string uniform_name(name.data(), length);
+		int location = glGetUniformLocation(ID, uniform_name.c_str());
+
+		// uniform block members have no location
+		if (location < 0)
+			continue;
+
+		// arrays come back as "name[0]", look them up by the plain name too
+		if (uniform_name.size() > 3 && uniform_name.compare(uniform_name.size() - 3, 3, "[0]") == 0)
+			m_uniform_locations[uniform_name.substr(0, uniform_name.size() - 3)] = location;
+		m_uniform_locations[uniform_name] = location;
+	}
+}
+
+int Shader::getUniformLocation(const char* name) const
+{
+	auto it = m_uniform_locations.find(name);
+	return it != m_uniform_locations.end() ? it->second : -1;
+}
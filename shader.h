@@ -1,5 +1,7 @@
 #pragma once
 #include <string>
+#include <map>
+#include <functional>
 
 class Shader
 {
@@ -10,6 +12,18 @@ public:
 	Shader(const char* vertexPath, const char* fragmentPath);
 	Shader(const char* computePath);
 
+	// compute shader with extra source (#defines, shared blocks) inserted right after the #version line
+	Shader(const char* computePath, const std::string& defines);
+
 	// use shader
 	void use();
+
+	// location from the table built at link time, -1 if the program has no such
+	// uniform (glUniform* ignores -1). no driver call, no string allocation
+	int getUniformLocation(const char* name) const;
+
+private:
+	std::map<std::string, int, std::less<>> m_uniform_locations;
+
+	void cacheUniformLocations();
 };
\ No newline at end of file
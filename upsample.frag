@@ -0,0 +1,98 @@
+#version 430 core
+out vec4 FragColor;
+in vec2 TexCoords;
+
+// joint bilateral upsample of the low res raymarch (RaymarchTarget). the guide is the ray's
+// box entry distance: computed here per full res pixel, stored by raymarch.frag per low res
+// pixel. low res texels whose entry is far off (other side of the cube's silhouette, or a
+// miss) lose their bilinear weight
+
+uniform sampler2D u_volume_color;
+uniform sampler2D u_volume_depth; // box entry distance, -1 where the ray missed
+
+uniform ivec2 u_scaled_size;      // used part of the low res textures
+uniform vec2 u_screen_size;
+
+uniform mat4 u_view_projection;
+uniform mat4 u_view_projection_inv;
+uniform mat4 u_model;
+uniform mat4 u_model_inv;
+uniform vec3 u_camera_pos;
+
+// entry distance difference (texture space units) at which a texel's weight drops to 1/e
+const float k_depth_sigma = .02;
+
+// same slab test as raymarch.frag, x = entry, y = exit
+vec2 intersectBox(vec3 origin, vec3 dir)
+{
+    vec3 t0 = (vec3(0.0) - origin) / dir;
+    vec3 t1 = (vec3(1.0) - origin) / dir;
+    vec3 t_min = min(t0, t1);
+    vec3 t_max = max(t0, t1);
+    return vec2(max(max(t_min.x, t_min.y), t_min.z), min(min(t_max.x, t_max.y), t_max.z));
+}
+
+void main()
+{
+    // the 4 low res texels around this pixel, nothing to do if they all missed the cube
+    vec2 low_pos = TexCoords * vec2(u_scaled_size) - 0.5;
+    ivec2 base = ivec2(floor(low_pos));
+    vec2 f = low_pos - vec2(base);
+
+    ivec2 texels[4];
+    vec4 texel_entry;
+    for (int i = 0; i < 4; ++i)
+    {
+        texels[i] = clamp(base + ivec2(i & 1, i >> 1), ivec2(0), u_scaled_size - 1);
+        texel_entry[i] = texelFetch(u_volume_depth, texels[i], 0).r;
+    }
+    if (all(lessThan(texel_entry, vec4(0.0))))
+        discard;
+
+    // this pixel's ray, the way raymarch.frag sets it up
+    vec2 ndc = gl_FragCoord.xy / u_screen_size * 2.0 - 1.0;
+    vec4 far_point = u_view_projection_inv * vec4(ndc, 1.0, 1.0);
+    vec3 ray_dir_world = far_point.xyz / far_point.w - u_camera_pos;
+
+    vec3 ray_origin = (u_model_inv * vec4(u_camera_pos, 1.0)).xyz + 0.5;
+    vec3 ray_dir = normalize((u_model_inv * vec4(ray_dir_world, 0.0)).xyz);
+
+    vec2 t_box = intersectBox(ray_origin, ray_dir);
+    float t_entry = max(t_box.x, 0.0);
+    if (t_box.y <= t_entry)
+        discard;
+
+    // bilinear weights, cut down by how far each texel's entry is from this pixel's.
+    // misses get nothing
+    vec4 bilinear = vec4((1.0 - f.x) * (1.0 - f.y), f.x * (1.0 - f.y), (1.0 - f.x) * f.y, f.x * f.y);
+    vec4 depth_diff = abs(texel_entry - t_entry);
+    vec4 weights = bilinear * exp(-depth_diff / k_depth_sigma) * step(0.0, texel_entry);
+
+    // nearest guide match, for when every texel around is on the wrong side of an edge
+    int closest = 0;
+    float closest_diff = 1e9;
+
+    vec4 color = vec4(0.0);
+    for (int i = 0; i < 4; ++i)
+    {
+        if (texel_entry[i] < 0.0)
+            continue;
+
+        vec4 texel_color = texelFetch(u_volume_color, texels[i], 0);
+        color += texel_color * weights[i];
+
+        if (depth_diff[i] < closest_diff)
+        {
+            closest_diff = depth_diff[i];
+            closest = i;
+        }
+    }
+
+    float weight_sum = dot(weights, vec4(1.0));
+    FragColor = weight_sum > 1e-4 ? color / weight_sum : texelFetch(u_volume_color, texels[closest], 0);
+
+    // back face depth, what the full res raymarch pass leaves in the depth buffer
+    vec3 exit_model = ray_origin + ray_dir * t_box.y - 0.5;
+    vec4 exit_clip = u_view_projection * u_model * vec4(exit_model, 1.0);
+    gl_FragDepth = exit_clip.z / exit_clip.w * 0.5 + 0.5;
+}